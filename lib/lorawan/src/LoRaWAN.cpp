@@ -28,12 +28,15 @@ LOG_SOURCE_CATEGORY("ncp.client");
 #include "stream_util.h"
 #include "hex_to_bytes.h"
 #include "STM32_Flash.h"
+#include "dct_hal.h"
 
 #include <str_util.h>
 
 // protobuf test code includes
 #include <memory>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <pb_encode.h>
 #include <cloud/cloud_new.pb.h>
 
@@ -128,15 +131,81 @@ namespace {
 
 #define LORA_NCP_DEFAULT_SERIAL_BAUDRATE (9600)
 #define LORA_NCP_RX_DATA_READ_TIMEOUT (3000)
+#define LORA_NCP_RESET_PULSE_WIDTH (10)
+#define LORA_NCP_READY_TIMEOUT (10000)
+#define LORA_NCP_READY_PROBE_PERIOD (100)
+
+const unsigned DEFAULT_DATA_RATE = 3; // data rate 3 for larger messages
+
+const system_tick_t SAVE_CONTEXT_RETRY_PERIOD = 1000;
+const system_tick_t DATA_RATE_RETRY_PERIOD = 1000;
+
+// Time to wait for the receive windows of an uplink to close after the end of its last transmission, unless
+// the module traces the end of RX2 earlier. RX2 opens 2 seconds after the transmission by default
+const uint64_t RX_WINDOWS_TIMEOUT = 10000;
+
+const uint32_t SESSION_RECORD_MAGIC = 0x4c53534eu; // "LSSN"
+const uint8_t SESSION_RECORD_VERSION = 1;
+
+// Session state kept in DCT. The frame counters are part of the module's context, which is
+// saved to its NVM with AT+QCS, see LoRaWANConfig::contextSaveInterval()
+struct __attribute__((packed)) SessionRecord {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t region;
+    uint8_t dataRate;
+    uint8_t valid;
+    uint8_t devEui[8];
+    uint8_t joinEui[8];
+    uint32_t epoch;
+    uint32_t appKeyHash;
+};
+
+const uint32_t FIRMWARE_RECORD_MAGIC = 0x4c465748u; // "LFWH"
+const size_t MAX_FIRMWARE_HASH_SIZE = 32;
+
+// Hash of the module firmware asset that was last flashed successfully
+struct __attribute__((packed)) FirmwareRecord {
+    uint32_t magic;
+    uint8_t hashSize;
+    uint8_t hash[MAX_FIRMWARE_HASH_SIZE];
+};
+
+// Layout of the DCT area used by the library
+const size_t SESSION_RECORD_OFFSET = 0;
+const size_t FIRMWARE_RECORD_OFFSET = 32;
+
+static_assert(SESSION_RECORD_OFFSET + sizeof(SessionRecord) <= FIRMWARE_RECORD_OFFSET, "SessionRecord is too large");
+static_assert(FIRMWARE_RECORD_OFFSET + sizeof(FirmwareRecord) <= LORAWAN_DCT_SIZE, "FirmwareRecord is too large");
+
+// FNV-1a, used to detect a key change without storing the key itself
+uint32_t keyHash(const uint8_t* data, size_t size) {
+    uint32_t h = 0x811c9dc5u;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ data[i]) * 0x01000193u;
+    }
+    return h;
+}
 
 } // annonymous
 
+LoRaWAN* LoRaWAN::instance_ = nullptr;
+
 LoRaWAN::LoRaWAN(int t, bool isMuon) :
-         begun_(false), isMuon_(isMuon), type_(t), rxDataReadActive_(false)
+         begun_(false), isMuon_(isMuon), type_(t), rxDataReadActive_(false),
+         rssiDiag_(linkStats_, DIAG_ID_LORAWAN_RSSI, "lorawan:rssi"),
+         snrDiag_(linkStats_, DIAG_ID_LORAWAN_SNR, "lorawan:snr"),
+         dataRateDiag_(linkStats_, DIAG_ID_LORAWAN_DATA_RATE, "lorawan:dr"),
+         freqDiag_(linkStats_, DIAG_ID_LORAWAN_FREQUENCY, "lorawan:freq"),
+         ackRateDiag_(linkStats_, DIAG_ID_LORAWAN_ACK_RATE, "lorawan:ackrate"),
+         uplinksDiag_(linkStats_, DIAG_ID_LORAWAN_UPLINKS, "lorawan:uplinks")
 {
 }
 
 LoRaWAN::~LoRaWAN() {
+    if (instance_ == this) {
+        instance_ = nullptr;
+    }
     if (begun_) {
         Mcp23s17::getInstance().setPinMode(resetPin_.first, resetPin_.second, INPUT);
         Mcp23s17::getInstance().setPinMode(bootPin_.first, bootPin_.second, INPUT);
@@ -168,6 +237,13 @@ int LoRaWAN::getNwJoinStatus(void) {
 int LoRaWAN::begin(const LoRaWANConfig& conf) {
     begun_ = true;
     conf_ = conf;
+    adr_.init(conf.adaptiveDataRate());
+    airtime_.init(conf.airtimeBudget());
+    if (conf.keepSession() && !instance_) {
+        // The uplinks sent after the last save would be dropped as replays once the session is resumed
+        instance_ = this;
+        System.on(reset, onSystemReset);
+    }
 
     if(isMuon_) {
         Mcp23s17::getInstance().begin();
@@ -196,24 +272,31 @@ int LoRaWAN::begin(const LoRaWANConfig& conf) {
     Mcp23s17::getInstance().setPinMode(resetPin_.first, resetPin_.second, OUTPUT);
     Mcp23s17::getInstance().writePinValue(resetPin_.first, resetPin_.second, HIGH);
     uint32_t s = millis();
-    while (millis() - s < 500) {
+    while (millis() - s < LORA_NCP_RESET_PULSE_WIDTH) {
         process();
     }
     Mcp23s17::getInstance().writePinValue(resetPin_.first, resetPin_.second, LOW);
 
-    // flush KG200Z bootup messages, or else buffer overrun will occur resulting in SOS 15
+    // Probe the module back-to-back until it answers. The probes also consume the KG200Z bootup messages,
+    // or else buffer overrun will occur resulting in SOS 15
     s = millis();
-    while (millis() - s < 2000) {
-        process();
-    }
-
-    CHECK(waitAtResponse(10000)); // Check if the module is alive
+    CHECK(waitAtResponse(LORA_NCP_READY_TIMEOUT, LORA_NCP_READY_PROBE_PERIOD)); // Check if the module is alive
+    Log.trace("Module ready in %lu ms", millis() - s);
     // CHECK_PARSER_OK(parser_.execCommand(10000, "ATQ?")); // DEBUG, see all AT commands
 
     Log.trace("Initializing protocol handler");
     CloudProtocolConfig protoConf;
-    protoConf.onSend([this](auto data, auto port, auto /* onAck */) {
-        return tx((const uint8_t*)data.data(), data.size(), port);
+    protoConf.onSend([this](auto data, auto port, auto confirmed, auto onAck) {
+        return tx((const uint8_t*)data.data(), data.size(), port, confirmed, std::move(onAck));
+    });
+    protoConf.eventBatching(conf.eventBatching());
+    protoConf.systemVersion(System.versionNumber());
+    protoConf.timeOnAir([this](size_t size) -> system_tick_t {
+        if (dataRate_ < 0) {
+            return 0;
+        }
+        int airtime = lorawanTimeOnAir(region_, dataRate_, size + LORAWAN_FRAME_OVERHEAD);
+        return (airtime > 0) ? airtime : 0;
     });
     int r = proto_.init(protoConf);
     if (r < 0) {
@@ -224,6 +307,19 @@ int LoRaWAN::begin(const LoRaWANConfig& conf) {
     // Check if the module state was saved to NVM so no additional setup is necessary
     int statusVal;
     CHECK(status(statusVal));
+    bool resumeSession = false;
+    if (conf.keepSession()) {
+        resumeSession = (restoreSession() == 0 && statusVal == 1);
+    }
+    if (resumeSession) {
+        // The module restored the session from its NVM; changing the band or keys would reset it
+        CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QVL=3"));
+        CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QADR=0"));
+        CHECK(setDataRate(dataRate_));
+        nwJoined = NW_JOIN_SUCCESS;
+        Log.info("Resumed network session %lu", sessionEpoch_);
+        return 0;
+    }
     if (statusVal == 1) {
 #if 0 // don't need this yet, if we are not using AT+QCS
         parser_.execCommand(2000, "AT+QRFS"); // Factory reset is the only way we've found to recover
@@ -233,9 +329,10 @@ int LoRaWAN::begin(const LoRaWANConfig& conf) {
     }
 
     CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QVL=3")); // default is 2
-    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QBAND=8")); // Band 8 is US
-    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QADR=0")); // disable auto data rate changes
-    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QDR=3")); // set data rate 3 for larger messages
+    CHECK(setRegion(conf.region()));
+    CHECK(setChannelPlan());
+    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QADR=0")); // disable auto data rate changes, see DataRateController
+    CHECK(setDataRate(DEFAULT_DATA_RATE));
 
     // Set the JoinEUI (AppEUI is the old name)
     char joinEUICmd[40];
@@ -331,6 +428,78 @@ int LoRaWAN::initParser(LoraStream* stream) {
         return SYSTEM_ERROR_NONE;
     }, this));
 
+    // +QEVT:RX_1, PORT 223, DR 3, RSSI -60, SNR 9
+    CHECK(parser_.addUrcHandler("+QEVT:RX_", [](AtResponseReader* reader, const char* prefix, void* data) -> int {
+        const auto self = (LoRaWAN*)data;
+        CString atResponse = reader->readLine();
+        CHECK_PARSER_URC(reader->error());
+
+        int dr = 0, rssi = 0, snr = 0;
+        int r = ::sscanf(atResponse, "+QEVT:RX_%*[^,], PORT %*d, DR %d, RSSI %d, SNR %d", &dr, &rssi, &snr);
+        CHECK_TRUE(r == 3, SYSTEM_ERROR_AT_RESPONSE_UNEXPECTED);
+        self->rxRssi_ = rssi;
+        self->rxSnr_ = snr;
+        self->linkStats_.downlinkReceived(rssi, snr);
+        if (self->ackMetricsPending_) {
+            self->adr_.uplinkAcked(rssi, snr);
+            self->ackMetricsPending_ = false;
+        } else {
+            self->hasRxMetrics_ = true;
+        }
+
+        return SYSTEM_ERROR_NONE;
+    }, this));
+
+    // Reported only if a confirmed uplink was acknowledged, see process() for the failure case
+    CHECK(parser_.addUrcHandler("+QEVT:SEND_CONFIRMED", [](AtResponseReader* reader, const char* prefix, void* data) -> int {
+        const auto self = (LoRaWAN*)data;
+        if (!self->uplinkPending_ || !self->uplinkConfirmed_) {
+            return SYSTEM_ERROR_NONE;
+        }
+        if (self->hasRxMetrics_) {
+            self->adr_.uplinkAcked(self->rxRssi_, self->rxSnr_);
+            self->hasRxMetrics_ = false;
+        } else {
+            self->ackMetricsPending_ = true; // The downlink is reported after the confirmation
+        }
+        self->uplinkCompleted(SYSTEM_ERROR_NONE);
+        return SYSTEM_ERROR_NONE;
+    }, this));
+
+    // MAC trace lines are prefixed with the uptime of the module rather than a fixed string:
+    // "542s442:TX on freq 903000000 Hz at DR 4"
+    CHECK(parser_.addUrcHandler("%us%u:", [](AtResponseReader* reader, const char* prefix, void* data) -> int {
+        const auto self = (LoRaWAN*)data;
+        CString atResponse = reader->readLine();
+        CHECK_PARSER_URC(reader->error());
+
+        unsigned long freq = 0;
+        int dr = 0;
+        if (::sscanf(atResponse, "%*us%*u:TX on freq %lu Hz at DR %d", &freq, &dr) == 2) {
+            self->linkStats_.transmissionStarted(freq, dr);
+            // Downlinks received before this transmission can't acknowledge it
+            self->hasRxMetrics_ = false;
+            self->ackMetricsPending_ = false;
+            self->rxDeadline_ = 0;
+            self->rx2Open_ = false;
+            // Account every transmission, including join requests and retransmissions
+            int airtime = lorawanTimeOnAir(self->region_, dr, self->txFrameSize_);
+            if (airtime > 0) {
+                self->airtime_.transmitted(System.millis(), airtime);
+            }
+        } else if (std::strstr(atResponse, ":MAC txDone") && self->uplinkPending_) {
+            // The module doesn't report a missing acknowledgement. A retransmission restarts the wait
+            self->rxDeadline_ = System.millis() + RX_WINDOWS_TIMEOUT;
+        } else if (std::strstr(atResponse, ":RX_2 on freq") && self->uplinkPending_) {
+            self->rx2Open_ = true;
+        } else if ((std::strstr(atResponse, ":MAC rxTimeOut") || std::strstr(atResponse, ":MAC rxDone")) &&
+                self->uplinkPending_ && !self->uplinkConfirmed_ && self->rx2Open_) {
+            // The module rejects new uplinks while its receive windows are open
+            self->uplinkCompleted(SYSTEM_ERROR_NONE);
+        }
+        return SYSTEM_ERROR_NONE; // Ignore other traces
+    }, this));
+
     return SYSTEM_ERROR_NONE;
 }
 
@@ -355,7 +524,11 @@ int LoRaWAN::join() {
     //       > AT+QJOIN=1
     //       < OK
     // Wait for NW_JOIN_SUCCESS URC
+    bool newSession = false;
+    const auto joinStart = millis();
+    txFrameSize_ = LORAWAN_JOIN_REQUEST_SIZE;
     while (nwJoined != NW_JOIN_SUCCESS) {
+        newSession = true;
         auto r = parser_.sendCommand(1000, "AT+QJOIN=1");
         CHECK_PARSER(r.readResult());
         auto s = millis();
@@ -371,7 +544,17 @@ int LoRaWAN::join() {
 
     CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QCLASS=C")); // must be set after the join process completes
 
-    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QDR=3")); // set data rate 3 for larger messages
+    if (newSession) {
+        Log.info("Joined in %lu ms", millis() - joinStart);
+        CHECK(setDataRate(DEFAULT_DATA_RATE));
+        adr_.reset(region_, dataRate_);
+        if (conf_.keepSession()) {
+            ++sessionEpoch_;
+            saveSession(); // Ignore errors, the device will rejoin on the next boot
+        }
+    } else {
+        adr_.reset(region_, dataRate_);
+    }
 
     Log.trace("Connecting to the Cloud");
     int r = proto_.connect();
@@ -387,10 +570,38 @@ int LoRaWAN::disconnect() {
     CHECK_PARSER_OK(parser_.execCommand(1000, "AT+QDISC"));
     CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QCS"));
     nwJoined = NW_JOIN_INIT;
+    if (uplinkPending_) {
+        uplinkCompleted(SYSTEM_ERROR_CANCELLED);
+    }
+    saveContextPending_ = false;
+    unsavedUplinks_ = 0;
+    saveSessionPending_ = false;
+    if (conf_.keepSession()) {
+        CHECK(saveSession(false /* valid */));
+    }
 
     return 0;
 }
 
+int LoRaWAN::saveContext() {
+    CHECK_TRUE(nwJoined == NW_JOIN_SUCCESS, SYSTEM_ERROR_INVALID_STATE);
+    CHECK_TRUE(!uplinkPending_, SYSTEM_ERROR_BUSY);
+    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QCS"));
+    saveContextPending_ = false;
+    unsavedUplinks_ = 0;
+    return 0;
+}
+
+void LoRaWAN::onSystemReset(system_event_t event, int param) {
+    const auto self = instance_;
+    if (self && self->unsavedUplinks_ > 0) {
+        int r = self->saveContext();
+        if (r < 0) {
+            Log.warn("Failed to save module context before reset: %d", r);
+        }
+    }
+}
+
 int LoRaWAN::firmwareVersion(String& version) {
     auto qverResp = parser_.sendCommand(1000, "AT+QVER=?");
     const char prefix[] = "Version Information: ";
@@ -417,24 +628,42 @@ int LoRaWAN::updateFirmware(bool force) {
     for (auto& asset: System.assetsAvailable()) {
         if (asset.name().startsWith("KG200Z")) {
             String updatedVersion = asset.name().substring(0, asset.name().indexOf('.'));
+            const auto& assetHash = asset.hash().hash();
 
             if (force) {
                 Log.info("Reflashing firmware %s", updatedVersion.c_str());
             } else {
-                String version;
-                firmwareVersion(version);
-                if (version == updatedVersion) {
-                    Log.info("Firmware up to date. Current: %s", version.c_str());
-                    return 0;
+                uint8_t hash[MAX_FIRMWARE_HASH_SIZE] = {};
+                int hashSize = readFirmwareHash(hash, sizeof(hash));
+                if (hashSize >= 0) {
+                    // The asset that was flashed last is known, no need to query the module
+                    if ((size_t)hashSize == assetHash.size() && memcmp(hash, assetHash.data(), hashSize) == 0) {
+                        Log.info("Firmware up to date. Current: %s", updatedVersion.c_str());
+                        return 0;
+                    }
+                    Log.info("Updating firmware to %s", asset.name().c_str());
                 } else {
-                    Log.info("Updating firmware from %s to %s", version.c_str(), updatedVersion.c_str());
+                    String version;
+                    firmwareVersion(version);
+                    if (version == updatedVersion) {
+                        Log.info("Firmware up to date. Current: %s", version.c_str());
+                        // Assume the module runs this asset so that the version doesn't need to be queried again
+                        saveFirmwareHash((const uint8_t*)assetHash.data(), assetHash.size()); // Ignore errors
+                        return 0;
+                    } else {
+                        Log.info("Updating firmware from %s to %s", version.c_str(), updatedVersion.c_str());
+                    }
                 }
             }
+            // Clear the stored hash in case flashing is interrupted
+            saveFirmwareHash(nullptr, 0); // Ignore errors
             int result = flashStm32Binary(asset, bootPin_, resetPin_, STM32_BOOT_NONINVERTED);
 
             if (result) {
                 // wait a bit before retrying after reboot
                 delay(10s);
+            } else {
+                saveFirmwareHash((const uint8_t*)assetHash.data(), assetHash.size()); // Ignore errors
             }
 
             // Reinitialize everything after reflashing the module
@@ -445,14 +674,171 @@ int LoRaWAN::updateFirmware(bool force) {
     return 0;
 }
 
-int LoRaWAN::tx(const uint8_t* buf, size_t len, int port) {
+int LoRaWAN::tx(const uint8_t* buf, size_t len, int port, bool confirmed, OnAck onAck) {
+    // The module accepts a new uplink only once the previous one is complete
+    CHECK_TRUE(!uplinkPending_, SYSTEM_ERROR_BUSY);
     auto hexBufSize = len * 2 + 1; // Includes term. null
     std::unique_ptr<char[]> hexBuf(new(std::nothrow) char[hexBufSize]);
     if (!hexBuf) {
         return Error::NO_MEMORY;
     }
     toHex(buf, len, hexBuf.get(), hexBufSize);
-    CHECK_PARSER_OK(parser_.execCommand(1000, "AT+QSEND=%d:%d:%s", port, 1 /* ack */, hexBuf.get()));
+    const auto now = System.millis();
+    const auto allowedAt = nextSendAllowedAt(len);
+    if (allowedAt > now) {
+        Log.warn("Airtime budget exceeded, next uplink allowed in %lu s", (unsigned long)((allowedAt - now) / 1000));
+        return SYSTEM_ERROR_LIMIT_EXCEEDED;
+    }
+    linkStats_.frameSent(millis(), confirmed);
+    txFrameSize_ = len + LORAWAN_FRAME_OVERHEAD; // The first transmission is traced before the command completes
+    NAMED_SCOPE_GUARD(cancelFrameGuard, {
+        linkStats_.frameCancelled();
+    });
+    const int r = CHECK_PARSER(parser_.execCommand(1000, "AT+QSEND=%d:%d:%s", port, confirmed ? 1 : 0, hexBuf.get()));
+    CHECK_TRUE(r != AtResponse::BUSY_ERROR, SYSTEM_ERROR_BUSY); // The MAC hasn't completed the previous uplink yet
+    CHECK_TRUE(r == AtResponse::OK, SYSTEM_ERROR_AT_NOT_OK);
+    cancelFrameGuard.dismiss();
+    uplinkAck_ = std::move(onAck);
+    uplinkPending_ = true;
+    uplinkConfirmed_ = confirmed;
+    uplinkDone_ = false;
+    return 0;
+}
+
+uint64_t LoRaWAN::nextSendAllowedAt(size_t payloadSize) const {
+    if (!airtime_.enabled() || dataRate_ < 0) {
+        return 0;
+    }
+    int airtime = lorawanTimeOnAir(region_, dataRate_, payloadSize + LORAWAN_FRAME_OVERHEAD);
+    if (airtime < 0) {
+        return 0;
+    }
+    return airtime_.nextAllowedAt(System.millis(), airtime);
+}
+
+void LoRaWAN::uplinkCompleted(int error) {
+    if (!uplinkPending_) {
+        return;
+    }
+    uplinkPending_ = false;
+    rxDeadline_ = 0;
+    rx2Open_ = false;
+    linkStats_.frameCompleted(uplinkConfirmed_ && error == SYSTEM_ERROR_NONE /* acked */);
+    // Saving the context on every uplink would wear out the module's NVM
+    if (conf_.keepSession() && ++unsavedUplinks_ >= std::max(conf_.contextSaveInterval(), 1u)) {
+        saveContextPending_ = true;
+    }
+    // Called from process() as the callback may send another uplink
+    uplinkResult_ = error;
+    uplinkDone_ = true;
+}
+
+int LoRaWAN::setRegion(LoRaWANRegion region) {
+    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QBAND=%u", (unsigned)region));
+    region_ = region;
+    dataRate_ = -1; // The module falls back to the default data rate of the region
+    return 0;
+}
+
+int LoRaWAN::setChannelPlan() {
+    if (conf_.rx2Frequency()) {
+        CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QRX2FQ=%lu", (unsigned long)conf_.rx2Frequency()));
+        CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QRX2DR=%u", conf_.rx2DataRate()));
+    }
+    return 0;
+}
+
+int LoRaWAN::setDataRate(unsigned dataRate) {
+    CHECK_TRUE(lorawanDataRate(region_, dataRate), SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_PARSER_OK(parser_.execCommand(2000, "AT+QDR=%u", dataRate));
+    bool changed = (dataRate_ != (int)dataRate);
+    dataRate_ = dataRate;
+    if (changed && nwJoined == NW_JOIN_SUCCESS && conf_.keepSession()) {
+        saveSessionPending_ = true;
+    }
+    return updateMaxPayloadSize();
+}
+
+int LoRaWAN::restoreSession() {
+    SessionRecord rec = {};
+    CHECK(dct_read_app_data_copy(conf_.dctOffset() + SESSION_RECORD_OFFSET, &rec, sizeof(rec)));
+    if (rec.magic != SESSION_RECORD_MAGIC || rec.version != SESSION_RECORD_VERSION) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    // Keep counting sessions from the last stored epoch even if the session can't be resumed
+    sessionEpoch_ = rec.epoch;
+    if (!rec.valid || memcmp(rec.devEui, conf_.devEui(), sizeof(rec.devEui)) != 0 ||
+            memcmp(rec.joinEui, conf_.joinEui(), sizeof(rec.joinEui)) != 0 ||
+            rec.appKeyHash != keyHash(conf_.appKey(), 16)) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    auto region = static_cast<LoRaWANRegion>(rec.region);
+    if (region != conf_.region()) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    CHECK_TRUE(lorawanDataRate(region, rec.dataRate), SYSTEM_ERROR_BAD_DATA);
+    region_ = region;
+    dataRate_ = rec.dataRate;
+    return 0;
+}
+
+int LoRaWAN::saveSession(bool valid) {
+    SessionRecord rec = {};
+    rec.magic = SESSION_RECORD_MAGIC;
+    rec.version = SESSION_RECORD_VERSION;
+    rec.epoch = sessionEpoch_;
+    if (valid) {
+        CHECK_TRUE(dataRate_ >= 0, SYSTEM_ERROR_INVALID_STATE);
+        rec.valid = 1;
+        rec.region = (uint8_t)region_;
+        rec.dataRate = dataRate_;
+        memcpy(rec.devEui, conf_.devEui(), sizeof(rec.devEui));
+        memcpy(rec.joinEui, conf_.joinEui(), sizeof(rec.joinEui));
+        rec.appKeyHash = keyHash(conf_.appKey(), 16);
+    }
+    int r = dct_write_app_data(&rec, conf_.dctOffset() + SESSION_RECORD_OFFSET, sizeof(rec));
+    if (r != 0) {
+        Log.error("Failed to save session: %d", r);
+        return SYSTEM_ERROR_FLASH_IO;
+    }
+    return 0;
+}
+
+int LoRaWAN::readFirmwareHash(uint8_t* hash, size_t size) {
+    CHECK_TRUE(conf_.dctOffset() >= 0, SYSTEM_ERROR_NOT_SUPPORTED);
+    FirmwareRecord rec = {};
+    CHECK(dct_read_app_data_copy(conf_.dctOffset() + FIRMWARE_RECORD_OFFSET, &rec, sizeof(rec)));
+    if (rec.magic != FIRMWARE_RECORD_MAGIC || !rec.hashSize || rec.hashSize > MAX_FIRMWARE_HASH_SIZE) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    memcpy(hash, rec.hash, std::min<size_t>(size, rec.hashSize));
+    return rec.hashSize;
+}
+
+int LoRaWAN::saveFirmwareHash(const uint8_t* hash, size_t size) {
+    CHECK_TRUE(conf_.dctOffset() >= 0, SYSTEM_ERROR_NOT_SUPPORTED);
+    CHECK_TRUE(size <= MAX_FIRMWARE_HASH_SIZE, SYSTEM_ERROR_TOO_LARGE);
+    FirmwareRecord rec = {};
+    if (size) {
+        rec.magic = FIRMWARE_RECORD_MAGIC;
+        rec.hashSize = size;
+        memcpy(rec.hash, hash, size);
+    }
+    int r = dct_write_app_data(&rec, conf_.dctOffset() + FIRMWARE_RECORD_OFFSET, sizeof(rec));
+    if (r != 0) {
+        Log.error("Failed to save firmware hash: %d", r);
+        return SYSTEM_ERROR_FLASH_IO;
+    }
+    return 0;
+}
+
+int LoRaWAN::updateMaxPayloadSize() {
+    if (dataRate_ < 0 || !lorawanDataRate(region_, dataRate_)) {
+        return 0; // Not known yet
+    }
+    size_t size = CHECK(lorawanMaxAppPayloadSize(region_, dataRate_));
+    Log.trace("Max payload size: %u (region: %u, DR: %d)", (unsigned)size, (unsigned)region_, dataRate_);
+    CHECK(proto_.changeMaxPayloadSize(size));
     return 0;
 }
 
@@ -465,6 +851,51 @@ int LoRaWAN::process() {
     parser_.processUrc(); // Ignore errors
     proto_.run();
 
+    // Data rate changes requested by the controller can't be applied from within a URC handler.
+    // The change is deferred while an uplink is in flight, and retried if the module rejects it
+    if (adr_.enabled() && adr_.dataRate() != dataRate_ && nwJoined == NW_JOIN_SUCCESS && !uplinkPending_ &&
+            millis() - dataRateTime_ >= DATA_RATE_RETRY_PERIOD) {
+        dataRateTime_ = millis();
+        int r = setDataRate(adr_.dataRate());
+        if (r < 0) {
+            Log.warn("Failed to change data rate: %d", r);
+        }
+    }
+
+    if (uplinkPending_ && rxDeadline_ && System.millis() >= rxDeadline_) {
+        if (uplinkConfirmed_) {
+            adr_.uplinkMissed();
+            hasRxMetrics_ = false;
+            uplinkCompleted(SYSTEM_ERROR_TIMEOUT); // No acknowledgement after all retransmissions
+        } else {
+            uplinkCompleted(SYSTEM_ERROR_NONE); // The end of RX2 wasn't traced
+        }
+    }
+
+    if (uplinkDone_) {
+        uplinkDone_ = false;
+        auto onAck = std::move(uplinkAck_);
+        uplinkAck_ = nullptr;
+        if (onAck) {
+            onAck(uplinkResult_);
+        }
+    }
+
+    // Save the module's context periodically so that a resumed session doesn't reuse too many frame counters.
+    // The module rejects the command while its MAC is busy, e.g. during the receive windows of an unconfirmed uplink
+    if (saveContextPending_ && nwJoined == NW_JOIN_SUCCESS && !uplinkPending_ &&
+            millis() - saveContextTime_ >= SAVE_CONTEXT_RETRY_PERIOD) {
+        saveContextTime_ = millis();
+        int r = saveContext();
+        if (r < 0) {
+            Log.warn("Failed to save module context: %d", r);
+        }
+    }
+    if (saveSessionPending_ && nwJoined == NW_JOIN_SUCCESS) {
+        saveSessionPending_ = false;
+        saveSession(); // Ignore errors
+    }
+
     // process received data
     // XXX: This was causing SOS 15 after it exited, and process() was called again, and processUrc() was called again.
     // if (!rxDataReadActive_ && rxDataLen_ > 0) {
@@ -23,6 +23,10 @@
 #include "serial_stream/lora_serial_stream.h"
 #include "system_error.h"
 #include "cloud_protocol.h"
+#include "region/lorawan_region.h"
+#include "adr/data_rate_controller.h"
+#include "link_stats/link_stats.h"
+#include "airtime/airtime_budget.h"
 #include "../../mcp23s17/src/mcp23s17.h"
 
 #include <optional>
@@ -35,6 +39,9 @@ const auto NW_JOIN_INIT = 0;
 const auto NW_JOIN_SUCCESS = 1;
 const auto NW_JOIN_FAILED = 2;
 
+// Size of the DCT area used by the library, see LoRaWANConfig::dctOffset()
+const auto LORAWAN_DCT_SIZE = 72;
+
 namespace particle {
 
 class LoRaWANConfig {
@@ -52,14 +59,65 @@ public:
     LoRaWANConfig& appKey(const uint8_t* appKey);
     const uint8_t* appKey() const;
 
+    // Defaults to US915
+    LoRaWANConfig& region(LoRaWANRegion region);
+    LoRaWANRegion region() const;
+
+    // Override the RX2 window parameters advertised by the network. A frequency of 0 keeps the region defaults
+    LoRaWANConfig& rx2(uint32_t frequency, unsigned dataRate);
+    uint32_t rx2Frequency() const;
+    unsigned rx2DataRate() const;
+
+    LoRaWANConfig& adaptiveDataRate(const DataRateControllerConfig& conf);
+    const DataRateControllerConfig& adaptiveDataRate() const;
+
+    // Uplinks that don't fit the budget are rejected with SYSTEM_ERROR_LIMIT_EXCEEDED. No limits by default
+    LoRaWANConfig& airtimeBudget(const AirtimeBudgetConfig& conf);
+    const AirtimeBudgetConfig& airtimeBudget() const;
+
+    // Offset of the DCT area where the library keeps its persistent state (LORAWAN_DCT_SIZE bytes)
+    LoRaWANConfig& dctOffset(uint32_t offset);
+    int dctOffset() const;
+
+    // Keep the network session across MCU resets instead of rejoining on every boot (requires dctOffset)
+    LoRaWANConfig& keepSession(bool enabled);
+    bool keepSession() const;
+
+    // Save the module context, which includes the frame counters, to its NVM every given number of uplinks
+    // while keepSession() is enabled. Defaults to 16. The context is also saved before a system reset.
+    // The network drops the uplinks that reuse the frame counters of the uplinks sent after the last save,
+    // so call LoRaWAN::saveContext() before entering sleep or removing power
+    LoRaWANConfig& contextSaveInterval(unsigned uplinks);
+    unsigned contextSaveInterval() const;
+
+    // Send the events published within the given time window (in milliseconds) in a single uplink.
+    // Disabled by default
+    LoRaWANConfig& eventBatching(system_tick_t window);
+    system_tick_t eventBatching() const;
 
 private:
     uint8_t devEui_[8];
     uint8_t joinEui_[8];
     uint8_t appKey_[16];
+    DataRateControllerConfig adrConf_;
+    AirtimeBudgetConfig airtimeConf_;
+    uint32_t rx2Freq_;
+    system_tick_t batchWindow_;
+    unsigned rx2DataRate_;
+    unsigned saveInterval_;
+    int dctOffset_;
+    LoRaWANRegion region_;
+    bool keepSession_;
 };
 
-inline LoRaWANConfig::LoRaWANConfig()
+inline LoRaWANConfig::LoRaWANConfig() :
+        rx2Freq_(0),
+        batchWindow_(0),
+        rx2DataRate_(0),
+        saveInterval_(16),
+        dctOffset_(-1),
+        region_(LoRaWANRegion::US915),
+        keepSession_(false)
 {
 }
 
@@ -104,11 +162,89 @@ inline const uint8_t* LoRaWANConfig::appKey() const {
     return appKey_;
 }
 
+inline LoRaWANConfig& LoRaWANConfig::region(LoRaWANRegion region) {
+    region_ = region;
+    return *this;
+}
+
+inline LoRaWANRegion LoRaWANConfig::region() const {
+    return region_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::rx2(uint32_t frequency, unsigned dataRate) {
+    rx2Freq_ = frequency;
+    rx2DataRate_ = dataRate;
+    return *this;
+}
+
+inline uint32_t LoRaWANConfig::rx2Frequency() const {
+    return rx2Freq_;
+}
+
+inline unsigned LoRaWANConfig::rx2DataRate() const {
+    return rx2DataRate_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::adaptiveDataRate(const DataRateControllerConfig& conf) {
+    adrConf_ = conf;
+    return *this;
+}
+
+inline const DataRateControllerConfig& LoRaWANConfig::adaptiveDataRate() const {
+    return adrConf_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::airtimeBudget(const AirtimeBudgetConfig& conf) {
+    airtimeConf_ = conf;
+    return *this;
+}
+
+inline const AirtimeBudgetConfig& LoRaWANConfig::airtimeBudget() const {
+    return airtimeConf_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::dctOffset(uint32_t offset) {
+    dctOffset_ = offset;
+    return *this;
+}
+
+inline int LoRaWANConfig::dctOffset() const {
+    return dctOffset_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::keepSession(bool enabled) {
+    keepSession_ = enabled;
+    return *this;
+}
+
+inline bool LoRaWANConfig::keepSession() const {
+    return keepSession_ && dctOffset_ >= 0;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::contextSaveInterval(unsigned uplinks) {
+    saveInterval_ = uplinks;
+    return *this;
+}
+
+inline unsigned LoRaWANConfig::contextSaveInterval() const {
+    return saveInterval_;
+}
+
+inline LoRaWANConfig& LoRaWANConfig::eventBatching(system_tick_t window) {
+    batchWindow_ = window;
+    return *this;
+}
+
+inline system_tick_t LoRaWANConfig::eventBatching() const {
+    return batchWindow_;
+}
+
 class LoraSerialStream;
 
 class LoRaWAN {
 
 public:
+    typedef std::function<void(int error)> OnAck;
 
     LoRaWAN( int t, bool isMuon = true);
     ~LoRaWAN();
@@ -120,17 +256,40 @@ public:
     int join(void);
     int firmwareVersion(String& version);
     int updateFirmware(bool force = false);
-    int tx(const uint8_t* buf, size_t len, int port);
+    // `onAck` is called from process() once the uplink completes: with 0 if the network acknowledged a confirmed
+    // uplink or the receive windows of an unconfirmed uplink closed, or with an error if no acknowledgement was
+    // received. Fails with SYSTEM_ERROR_BUSY while the module is busy with the previous uplink
+    int tx(const uint8_t* buf, size_t len, int port, bool confirmed = true, OnAck onAck = nullptr);
     int disconnect(void);
+    // Save the module context to its NVM, e.g. before entering sleep. See LoRaWANConfig::contextSaveInterval()
+    int saveContext();
+
+    int publish(int code, const Variant& data, constrained::PublishOptions opts = constrained::PublishOptions()) {
+        return proto_.publish(code, data, std::move(opts));
+    }
 
-    int publish(int code, const Variant& data) {
-        return proto_.publish(code, data);
+    // Publish an event using the binary layout defined by a constrained::EventSchema
+    template<typename SchemaT>
+    int publish(const SchemaT& schema, const typename SchemaT::Type& data,
+            constrained::PublishOptions opts = constrained::PublishOptions()) {
+        return proto_.publish(schema, data, std::move(opts));
     }
 
     int subscribe(int code, constrained::CloudProtocol::OnEvent onEvent) {
         return proto_.subscribe(code, std::move(onEvent));
     }
 
+    template<typename SchemaT, typename F, typename = typename SchemaT::Type>
+    int subscribe(const SchemaT& schema, F fn) {
+        return proto_.subscribe(schema, std::move(fn));
+    }
+
+    // Send the data of the events with the given code as bit-packed fields instead of CBOR
+    template<size_t N>
+    int setPackedEncoding(int code, const util::PackedField (&fields)[N]) {
+        return proto_.setPackedEncoding(code, fields);
+    }
+
     uint16_t available(void) const;
     int process();
     int waitAtResponse(unsigned int timeout, unsigned int period = 1000);
@@ -139,8 +298,20 @@ public:
     AtParser* atParser();
     int getNwJoinStatus(void);
 
+    LoRaWANRegion region() const;
+    int dataRate() const;
+    int maxPayloadSize() const;
+    const LinkStats& linkStats() const;
+
+    // Get the earliest time at which an uplink with a given application payload size fits the airtime
+    // budget, see System.millis(). Defaults to the maximum payload size at the current data rate
+    uint64_t nextSendAllowedAt(size_t payloadSize) const;
+    uint64_t nextSendAllowedAt() const;
+
 private:
 
+    static LoRaWAN* instance_;          // instance that saves the module context before a system reset
+
     bool begun_;                        // true if begin() previously called
     bool isMuon_;
     std::pair<uint8_t, uint8_t> intPin_     = {MCP23S17_PORT_A, 7};
@@ -158,16 +329,80 @@ private:
     uint8_t nwJoined = NW_JOIN_INIT;
 
     LoRaWANConfig conf_;
+    LoRaWANRegion region_ = LoRaWANRegion::US915;
+    int dataRate_ = -1;                 // current data rate, or -1 if unknown
+    DataRateController adr_;
+    LinkStats linkStats_;
+    AirtimeBudget airtime_;
+    size_t txFrameSize_ = 0;            // PHYPayload size of the frame being transmitted
+    LinkStatsDiagnosticData rssiDiag_;
+    LinkStatsDiagnosticData snrDiag_;
+    LinkStatsDiagnosticData dataRateDiag_;
+    LinkStatsDiagnosticData freqDiag_;
+    LinkStatsDiagnosticData ackRateDiag_;
+    LinkStatsDiagnosticData uplinksDiag_;
+    int rxRssi_ = 0;                    // metrics of the last received downlink
+    int rxSnr_ = 0;
+    bool hasRxMetrics_ = false;
+    bool ackMetricsPending_ = false;    // the metrics of the acknowledging downlink haven't been reported yet
+    uint32_t sessionEpoch_ = 0;         // incremented on every OTAA join, see keepSession()
+    OnAck uplinkAck_;                   // completion callback of the uplink in flight
+    int uplinkResult_ = 0;
+    bool uplinkPending_ = false;        // an uplink was accepted by the module and hasn't completed yet
+    bool uplinkConfirmed_ = false;
+    uint64_t rxDeadline_ = 0;           // uptime by which the receive windows of the uplink close, or 0
+    bool rx2Open_ = false;              // the second receive window of the uplink is open
+    bool uplinkDone_ = false;           // `uplinkAck_` needs to be called with `uplinkResult_`
+    bool saveContextPending_ = false;   // module context needs to be saved to its NVM
+    unsigned unsavedUplinks_ = 0;       // uplinks completed since the module context was last saved
+    system_tick_t saveContextTime_ = 0; // time of the last attempt to save the module context
+    system_tick_t dataRateTime_ = 0;    // time of the last attempt to apply the data rate chosen by the ADR controller
+    bool saveSessionPending_ = false;   // session record needs to be saved to DCT
 
     constrained::CloudProtocol proto_;
 
     int publishImpl(int code, const std::optional<Variant>& data = std::nullopt);
+    void uplinkCompleted(int error);
+
+    static void onSystemReset(system_event_t event, int param);
+    int setRegion(LoRaWANRegion region);
+    int setChannelPlan();
+    int setDataRate(unsigned dataRate);
+    int updateMaxPayloadSize();
+    int restoreSession();
+    int saveSession(bool valid = true);
+    int readFirmwareHash(uint8_t* hash, size_t size);
+    int saveFirmwareHash(const uint8_t* hash, size_t size);
 };
 
 inline AtParser* LoRaWAN::atParser() {
     return &parser_;
 }
 
+inline LoRaWANRegion LoRaWAN::region() const {
+    return region_;
+}
+
+inline int LoRaWAN::dataRate() const {
+    return dataRate_;
+}
+
+inline const LinkStats& LoRaWAN::linkStats() const {
+    return linkStats_;
+}
+
+inline uint64_t LoRaWAN::nextSendAllowedAt() const {
+    const int size = maxPayloadSize();
+    return nextSendAllowedAt((size < 0) ? 0 : size);
+}
+
+inline int LoRaWAN::maxPayloadSize() const {
+    if (dataRate_ < 0) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    return lorawanMaxAppPayloadSize(region_, dataRate_);
+}
+
 inline void LoRaWAN::parserError(int error) {
     Log.error("%d", error);
     parserError_ = error;
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "data_rate_controller.h"
+
+#include "logging.h"
+LOG_SOURCE_CATEGORY("ncp.adr");
+
+#include <algorithm>
+
+namespace particle {
+
+namespace {
+
+// Each data rate step changes the demodulation floor by 2.5 dB; use a slightly larger step so
+// that the data rate does not oscillate between two neighbouring values
+const int SNR_STEP_X10 = 30;
+
+// Demodulation floor of a LoRa spreading factor, in tenths of a dB
+int requiredSnrX10(unsigned spreadingFactor) {
+    return -25 * ((int)spreadingFactor - 4);
+}
+
+} // namespace
+
+DataRateController::DataRateController() :
+        region_(LoRaWANRegion::US915),
+        snrHistory_(),
+        historyCount_(0),
+        missedAcks_(0),
+        dataRate_(-1),
+        lastRssi_(0),
+        lastSnr_(0) {
+}
+
+void DataRateController::init(const DataRateControllerConfig& conf) {
+    conf_ = conf;
+    conf_.historySize(std::clamp<unsigned>(conf.historySize(), 1, MAX_HISTORY_SIZE));
+    conf_.maxMissedAcks(std::max(conf.maxMissedAcks(), 1u));
+}
+
+void DataRateController::reset(LoRaWANRegion region, unsigned dataRate) {
+    region_ = region;
+    dataRate_ = dataRate;
+    historyCount_ = 0;
+    missedAcks_ = 0;
+}
+
+void DataRateController::uplinkAcked(int rssi, int snr) {
+    lastRssi_ = rssi;
+    lastSnr_ = snr;
+    missedAcks_ = 0;
+    if (!enabled()) {
+        return;
+    }
+    snrHistory_[historyCount_++] = std::clamp(snr, INT8_MIN, INT8_MAX);
+    if (historyCount_ < conf_.historySize()) {
+        return;
+    }
+    const auto dr = lorawanDataRate(region_, dataRate_);
+    if (!dr || !dr->spreadingFactor) {
+        historyCount_ = 0;
+        return;
+    }
+    const int maxSnr = *std::max_element(snrHistory_, snrHistory_ + historyCount_);
+    const int marginX10 = maxSnr * 10 - requiredSnrX10(dr->spreadingFactor) - conf_.snrMargin() * 10;
+    if (marginX10 >= SNR_STEP_X10 && dataRate_ < maxDataRate()) {
+        changeDataRate(dataRate_ + 1);
+    } else if (marginX10 < 0 && dataRate_ > (int)conf_.minDataRate()) {
+        changeDataRate(dataRate_ - 1);
+    } else {
+        historyCount_ = 0;
+    }
+}
+
+void DataRateController::uplinkMissed() {
+    ++missedAcks_;
+    if (!enabled() || dataRate_ <= (int)conf_.minDataRate()) {
+        return;
+    }
+    if (missedAcks_ >= conf_.maxMissedAcks() * 2) {
+        Log.warn("No acknowledgements received, falling back to DR %u", conf_.minDataRate());
+        changeDataRate(conf_.minDataRate());
+        missedAcks_ = 0;
+    } else if (missedAcks_ == conf_.maxMissedAcks()) {
+        changeDataRate(dataRate_ - 1);
+    }
+}
+
+void DataRateController::changeDataRate(int dataRate) {
+    Log.info("Changing data rate from %d to %d", dataRate_, dataRate);
+    dataRate_ = dataRate;
+    historyCount_ = 0;
+}
+
+int DataRateController::maxDataRate() const {
+    if (conf_.maxDataRate() >= 0) {
+        return conf_.maxDataRate();
+    }
+    int maxDr = conf_.minDataRate();
+    for (unsigned i = conf_.minDataRate(); lorawanDataRate(region_, i); ++i) {
+        auto dr = lorawanDataRate(region_, i);
+        if (dr->spreadingFactor && dr->bandwidth == 125) {
+            maxDr = i;
+        }
+    }
+    return maxDr;
+}
+
+} // particle
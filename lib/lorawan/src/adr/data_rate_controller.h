@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "region/lorawan_region.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particle {
+
+class DataRateControllerConfig {
+
+public:
+    DataRateControllerConfig();
+
+    // Disabled by default, in which case the data rate stays at the value set by LoRaWAN
+    DataRateControllerConfig& enabled(bool enabled);
+    bool enabled() const;
+
+    DataRateControllerConfig& minDataRate(unsigned dataRate);
+    unsigned minDataRate() const;
+
+    // Defaults to the fastest 125 kHz LoRa data rate of the region
+    DataRateControllerConfig& maxDataRate(unsigned dataRate);
+    int maxDataRate() const;
+
+    // Link margin in dB required on top of the demodulation floor before the data rate is increased
+    DataRateControllerConfig& snrMargin(int margin);
+    int snrMargin() const;
+
+    // Number of acknowledged uplinks collected before the data rate can be changed based on SNR
+    DataRateControllerConfig& historySize(unsigned size);
+    unsigned historySize() const;
+
+    // Number of consecutive unacknowledged uplinks after which the data rate is lowered by one step.
+    // Twice as many make the controller fall back to the minimum data rate
+    DataRateControllerConfig& maxMissedAcks(unsigned count);
+    unsigned maxMissedAcks() const;
+
+private:
+    int maxDataRate_;
+    unsigned minDataRate_;
+    unsigned historySize_;
+    unsigned maxMissedAcks_;
+    int snrMargin_;
+    bool enabled_;
+};
+
+inline DataRateControllerConfig::DataRateControllerConfig() :
+        maxDataRate_(-1),
+        minDataRate_(0),
+        historySize_(8),
+        maxMissedAcks_(3),
+        snrMargin_(10),
+        enabled_(false) {
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::enabled(bool enabled) {
+    enabled_ = enabled;
+    return *this;
+}
+
+inline bool DataRateControllerConfig::enabled() const {
+    return enabled_;
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::minDataRate(unsigned dataRate) {
+    minDataRate_ = dataRate;
+    return *this;
+}
+
+inline unsigned DataRateControllerConfig::minDataRate() const {
+    return minDataRate_;
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::maxDataRate(unsigned dataRate) {
+    maxDataRate_ = dataRate;
+    return *this;
+}
+
+inline int DataRateControllerConfig::maxDataRate() const {
+    return maxDataRate_;
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::snrMargin(int margin) {
+    snrMargin_ = margin;
+    return *this;
+}
+
+inline int DataRateControllerConfig::snrMargin() const {
+    return snrMargin_;
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::historySize(unsigned size) {
+    historySize_ = size;
+    return *this;
+}
+
+inline unsigned DataRateControllerConfig::historySize() const {
+    return historySize_;
+}
+
+inline DataRateControllerConfig& DataRateControllerConfig::maxMissedAcks(unsigned count) {
+    maxMissedAcks_ = count;
+    return *this;
+}
+
+inline unsigned DataRateControllerConfig::maxMissedAcks() const {
+    return maxMissedAcks_;
+}
+
+/**
+ * Application-side adaptive data rate.
+ *
+ * The module's own ADR is disabled so that the data rate can be kept high enough for the protocol
+ * frames. This controller raises the data rate when the downlinks acknowledging confirmed uplinks
+ * show enough SNR headroom, and lowers it when the link degrades or acknowledgements go missing.
+ */
+class DataRateController {
+
+public:
+    static const size_t MAX_HISTORY_SIZE = 20;
+
+    DataRateController();
+
+    void init(const DataRateControllerConfig& conf);
+    void reset(LoRaWANRegion region, unsigned dataRate);
+
+    // Report an acknowledged uplink along with the metrics of the downlink that carried the ACK
+    void uplinkAcked(int rssi, int snr);
+    // Report an uplink for which no acknowledgement was received
+    void uplinkMissed();
+
+    bool enabled() const;
+    int dataRate() const;
+
+    int lastRssi() const;
+    int lastSnr() const;
+
+private:
+    DataRateControllerConfig conf_;
+    LoRaWANRegion region_;
+    int8_t snrHistory_[MAX_HISTORY_SIZE];
+    unsigned historyCount_;
+    unsigned missedAcks_;
+    int dataRate_;
+    int lastRssi_;
+    int lastSnr_;
+
+    void changeDataRate(int dataRate);
+    int maxDataRate() const;
+};
+
+inline bool DataRateController::enabled() const {
+    return conf_.enabled() && dataRate_ >= 0;
+}
+
+inline int DataRateController::dataRate() const {
+    return dataRate_;
+}
+
+inline int DataRateController::lastRssi() const {
+    return lastRssi_;
+}
+
+inline int DataRateController::lastSnr() const {
+    return lastSnr_;
+}
+
+} // particle
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "airtime_budget.h"
+
+#include "system_error.h"
+
+#include <algorithm>
+
+namespace particle {
+
+namespace {
+
+const unsigned PREAMBLE_SYMBOLS = 8;
+const unsigned CODING_RATE = 1; // 4/5
+
+const unsigned FSK_BIT_TIME_US = 20; // 50 kbps
+// Preamble, sync word, length and CRC
+const size_t FSK_OVERHEAD = 5 + 3 + 1 + 2;
+
+} // namespace
+
+int lorawanTimeOnAir(LoRaWANRegion region, unsigned dataRate, size_t size) {
+    auto dr = lorawanDataRate(region, dataRate);
+    if (!dr) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+    uint32_t us = 0;
+    if (!dr->spreadingFactor) {
+        us = (size + FSK_OVERHEAD) * 8 * FSK_BIT_TIME_US;
+    } else {
+        const int sf = dr->spreadingFactor;
+        const uint32_t symbolUs = (1000u << sf) / dr->bandwidth;
+        // Low data rate optimization is mandated for symbols longer than 16 ms
+        const int lowDataRateOpt = (symbolUs > 16000) ? 1 : 0;
+        const int n = 8 * (int)size - 4 * sf + 28 + 16 /* CRC */;
+        const int d = 4 * (sf - 2 * lowDataRateOpt);
+        const int payloadSymbols = 8 + std::max((n + d - 1) / d, 0) * (CODING_RATE + 4);
+        // The preamble is followed by 4.25 symbols of sync word
+        us = symbolUs * (4 * PREAMBLE_SYMBOLS + 17 + 4 * payloadSymbols) / 4;
+    }
+    return (us + 999) / 1000;
+}
+
+AirtimeBudget::AirtimeBudget() :
+        buckets_(),
+        lastBucket_(0),
+        offTimeEnd_(0) {
+}
+
+void AirtimeBudget::init(const AirtimeBudgetConfig& conf) {
+    conf_ = conf;
+    std::fill(buckets_, buckets_ + BUCKET_COUNT, 0);
+    lastBucket_ = 0;
+    offTimeEnd_ = 0;
+}
+
+void AirtimeBudget::transmitted(uint64_t time, uint32_t airtime) {
+    const auto bucket = time / BUCKET_DURATION;
+    if (bucket > lastBucket_) {
+        // Clear the buckets of the hours in which nothing was transmitted
+        const auto n = std::min<uint64_t>(bucket - lastBucket_, (uint64_t)BUCKET_COUNT);
+        for (uint64_t i = 1; i <= n; ++i) {
+            buckets_[(lastBucket_ + i) % BUCKET_COUNT] = 0;
+        }
+        lastBucket_ = bucket;
+    }
+    buckets_[lastBucket_ % BUCKET_COUNT] += airtime;
+    if (conf_.maxDutyCycle()) {
+        offTimeEnd_ = std::max(offTimeEnd_, time + (uint64_t)airtime * conf_.maxDutyCycle());
+    }
+}
+
+uint64_t AirtimeBudget::nextAllowedAt(uint64_t now, uint32_t airtime) const {
+    auto t = std::max(now, offTimeEnd_);
+    const auto limit = conf_.dailyLimit();
+    if (!limit) {
+        return t;
+    }
+    if (airtime > limit) {
+        return UINT64_MAX;
+    }
+    // Drop the oldest buckets until the transmission fits
+    auto used = dailyUsage(t);
+    const auto bucket = t / BUCKET_DURATION;
+    for (size_t i = 0; used + airtime > limit; ++i) {
+        const auto b = bucket + 1 + i - BUCKET_COUNT;
+        if (b <= lastBucket_) {
+            used -= buckets_[b % BUCKET_COUNT];
+        }
+        t = (b + BUCKET_COUNT) * BUCKET_DURATION;
+    }
+    return t;
+}
+
+uint32_t AirtimeBudget::dailyUsage(uint64_t now) const {
+    const auto bucket = now / BUCKET_DURATION;
+    uint32_t used = 0;
+    for (size_t i = 0; i < BUCKET_COUNT && i <= lastBucket_; ++i) {
+        const auto b = lastBucket_ - i;
+        if (b + BUCKET_COUNT > bucket) {
+            used += buckets_[b % BUCKET_COUNT];
+        }
+    }
+    return used;
+}
+
+} // particle
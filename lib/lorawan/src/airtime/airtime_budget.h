@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "region/lorawan_region.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particle {
+
+// MHDR, FHDR without FOpts, FPort and MIC
+const size_t LORAWAN_FRAME_OVERHEAD = 13;
+// PHYPayload of a join request
+const size_t LORAWAN_JOIN_REQUEST_SIZE = 23;
+
+/**
+ * Get the time on air of a frame.
+ *
+ * Uses the formula from the Semtech SX1276 datasheet with the parameters of LoRaWAN uplinks: explicit
+ * header, CRC enabled, coding rate 4/5 and an 8 symbol preamble.
+ *
+ * @param region Region.
+ * @param dataRate Data rate.
+ * @param size Size of the PHYPayload in bytes.
+ * @return Time on air in milliseconds, or an error code.
+ */
+int lorawanTimeOnAir(LoRaWANRegion region, unsigned dataRate, size_t size);
+
+class AirtimeBudgetConfig {
+
+public:
+    AirtimeBudgetConfig();
+
+    // Limit the transmitter duty cycle to 1/n, e.g. 100 for 1%. The off period required after a
+    // transmission is enforced before the next uplink. 0 disables the limit
+    AirtimeBudgetConfig& maxDutyCycle(unsigned n);
+    unsigned maxDutyCycle() const;
+
+    // Limit the total time on air within any 24 hour window, e.g. 30000 ms for the fair use policy
+    // of The Things Network. 0 disables the limit
+    AirtimeBudgetConfig& dailyLimit(uint32_t ms);
+    uint32_t dailyLimit() const;
+
+private:
+    uint32_t dailyLimit_;
+    unsigned maxDutyCycle_;
+};
+
+inline AirtimeBudgetConfig::AirtimeBudgetConfig() :
+        dailyLimit_(0),
+        maxDutyCycle_(0) {
+}
+
+inline AirtimeBudgetConfig& AirtimeBudgetConfig::maxDutyCycle(unsigned n) {
+    maxDutyCycle_ = n;
+    return *this;
+}
+
+inline unsigned AirtimeBudgetConfig::maxDutyCycle() const {
+    return maxDutyCycle_;
+}
+
+inline AirtimeBudgetConfig& AirtimeBudgetConfig::dailyLimit(uint32_t ms) {
+    dailyLimit_ = ms;
+    return *this;
+}
+
+inline uint32_t AirtimeBudgetConfig::dailyLimit() const {
+    return dailyLimit_;
+}
+
+/**
+ * Time on air accounting.
+ *
+ * The daily limit is tracked in hourly buckets, so the window slides in steps of one hour. All times
+ * are in milliseconds since boot, see `System.millis()`.
+ */
+class AirtimeBudget {
+
+public:
+    static const size_t BUCKET_COUNT = 24;
+    static const uint64_t BUCKET_DURATION = 3600000;
+
+    AirtimeBudget();
+
+    void init(const AirtimeBudgetConfig& conf);
+
+    // Record a transmission, including retransmissions of the same frame
+    void transmitted(uint64_t time, uint32_t airtime);
+
+    // Get the earliest time at which a transmission of a given duration fits the budget, or UINT64_MAX
+    // if it never will
+    uint64_t nextAllowedAt(uint64_t now, uint32_t airtime) const;
+
+    // Time on air within the last 24 hours
+    uint32_t dailyUsage(uint64_t now) const;
+
+    bool enabled() const;
+
+private:
+    AirtimeBudgetConfig conf_;
+    uint32_t buckets_[BUCKET_COUNT];
+    uint64_t lastBucket_;       // Index of the most recent bucket, counted in hours since boot
+    uint64_t offTimeEnd_;       // End of the off period required by the duty cycle limit
+};
+
+inline bool AirtimeBudget::enabled() const {
+    return conf_.maxDutyCycle() || conf_.dailyLimit();
+}
+
+} // particle
@@ -346,6 +346,9 @@ public:
      * Only one handler can be associated with a given prefix string. A new handler registered for
      * the same prefix string replaces the existing handler.
      *
+     * `%u` in the prefix string matches one or more decimal digits, e.g. `"%us%u:"` matches
+     * `"542s442:"`. If several prefixes match a line, the handler with the longest match is called.
+     *
      * @param prefix URC prefix string.
      * @param handler Callback function.
      * @param data User data.
@@ -53,7 +53,8 @@ const ResultCode RESULT_CODES[] = {
     { AtResponse::NO_DIALTONE, "NO DIALTONE", 11 },
     { AtResponse::CME_ERROR, "+CME ERROR", 10 },
     { AtResponse::CMS_ERROR, "+CMS ERROR", 10 },
-    { AtResponse::PARAM_ERROR, "PARAM_ERROR", 11 }
+    { AtResponse::PARAM_ERROR, "PARAM_ERROR", 11 },
+    { AtResponse::BUSY_ERROR, "BUSY_ERROR", 10 }
 };
 
 const size_t RESULT_CODE_COUNT = sizeof(RESULT_CODES) / sizeof(RESULT_CODES[0]);
@@ -88,6 +89,46 @@ size_t findNewline(const char* data, size_t size) {
     return size;
 }
 
+enum class PrefixMatch {
+    NONE, // The data doesn't start with the prefix
+    PARTIAL, // The data matches the beginning of the prefix
+    FULL // The data starts with the prefix
+};
+
+// Matches the beginning of the data against a URC prefix, in which "%u" stands for one or more decimal
+// digits. `size` is set to the number of characters of the data matched so far
+PrefixMatch matchPrefix(const char* data, size_t dataSize, const char* prefix, size_t* size) {
+    size_t i = 0;
+    while (*prefix) {
+        if (prefix[0] == '%' && prefix[1] == 'u') {
+            const size_t start = i;
+            while (i < dataSize && isdigit((unsigned char)data[i])) {
+                ++i;
+            }
+            *size = i;
+            if (i == dataSize) {
+                return PrefixMatch::PARTIAL; // The number may continue
+            }
+            if (i == start) {
+                return PrefixMatch::NONE;
+            }
+            prefix += 2;
+        } else {
+            *size = i;
+            if (i == dataSize) {
+                return PrefixMatch::PARTIAL;
+            }
+            if (data[i] != *prefix) {
+                return PrefixMatch::NONE;
+            }
+            ++i;
+            ++prefix;
+        }
+    }
+    *size = i;
+    return PrefixMatch::FULL;
+}
+
 inline system_tick_t millis() {
     return HAL_Timer_Get_Milli_Seconds();
 }
@@ -271,7 +312,6 @@ int AtParserImpl::addUrcHandler(const char* prefix, AtParser::UrcHandler handler
     removeUrcHandler(prefix);
     UrcHandler h = {};
     h.prefix = prefix;
-    h.prefixSize = prefixSize;
     h.callback = handler;
     h.data = data;
     if (!urcHandlers_.append(std::move(h))) {
@@ -480,19 +520,22 @@ int AtParserImpl::parseUrc(const UrcHandler** handler) {
     }
     // Look for an URC prefix that matches the buffer contents
     const UrcHandler* h = nullptr;
+    auto match = PrefixMatch::NONE;
     size_t maxSize = 0;
     for (size_t i = 0; i < (size_t)urcHandlers_.size(); ++i) {
         const UrcHandler& h2 = urcHandlers_.at(i);
-        const size_t n = std::min(bufPos_, h2.prefixSize);
-        if (memcmp(buf_, h2.prefix, n) == 0 && n > maxSize) {
+        size_t n = 0;
+        const auto m = matchPrefix(buf_, bufPos_, h2.prefix, &n);
+        if (m != PrefixMatch::NONE && n > maxSize) {
             h = &h2;
+            match = m;
             maxSize = n;
         }
     }
     if (!h) {
         return ParseResult::NO_MATCH;
     }
-    if (bufPos_ < h->prefixSize) {
+    if (match == PrefixMatch::PARTIAL) {
         return ParseResult::READ_MORE;
     }
     *handler = h;
@@ -106,7 +106,6 @@ private:
 
     struct UrcHandler {
         const char* prefix; // Prefix string
-        size_t prefixSize; // Size of the prefix string
         AtParser::UrcHandler callback; // Handler callback
         void* data; // User data
     };
@@ -179,7 +179,8 @@ public:
         NO_DIALTONE = 5,
         CME_ERROR = 6,
         CMS_ERROR = 7,
-        PARAM_ERROR = 8
+        PARAM_ERROR = 8,
+        BUSY_ERROR = 9
     };
 
     /**
@@ -1,3 +1,11 @@
-#include <vector>
+#pragma once
 
-int getDiagnosticValue(uint32_t id, std::vector<uint8_t>* res);
\ No newline at end of file
+#include <cstddef>
+#include <cstdint>
+
+// Size of an encoded diagnostic value
+const size_t DIAG_VALUE_SIZE = 4;
+
+// Get the current value of a diagnostic source encoded as a big-endian 32-bit integer. Returns the
+// size of the encoded value, which is 0 for sources of unsupported types
+int getDiagnosticValue(uint32_t id, uint8_t* data, size_t size);
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "link_stats.h"
+
+namespace particle {
+
+LinkStats::LinkStats() :
+        records_(),
+        pending_(),
+        next_(0),
+        count_(0),
+        frameCount_(0),
+        hasPending_(false) {
+}
+
+void LinkStats::frameSent(system_tick_t time, bool confirmed) {
+    if (hasPending_) {
+        commit(); // No acknowledgement was requested or reported for the previous frame
+    }
+    pending_ = LinkRecord();
+    pending_.time = time;
+    pending_.dataRate = -1;
+    pending_.confirmed = confirmed;
+    hasPending_ = true;
+    ++frameCount_;
+}
+
+void LinkStats::frameCancelled() {
+    if (hasPending_) {
+        hasPending_ = false;
+        --frameCount_;
+    }
+}
+
+void LinkStats::transmissionStarted(uint32_t frequency, int dataRate) {
+    if (!hasPending_) {
+        return;
+    }
+    pending_.frequency = frequency;
+    pending_.dataRate = dataRate;
+    if (pending_.attempts < UINT8_MAX) {
+        ++pending_.attempts;
+    }
+}
+
+void LinkStats::downlinkReceived(int rssi, int snr) {
+    if (!hasPending_) {
+        return;
+    }
+    pending_.rssi = rssi;
+    pending_.snr = snr;
+    pending_.hasDownlink = true;
+}
+
+void LinkStats::frameCompleted(bool acked) {
+    if (!hasPending_) {
+        return;
+    }
+    pending_.acked = acked;
+    commit();
+}
+
+int LinkStats::ackRate() const {
+    size_t confirmed = 0;
+    size_t acked = 0;
+    for (size_t i = 0; i < count_; ++i) {
+        auto& rec = record(i);
+        if (rec.confirmed) {
+            ++confirmed;
+            if (rec.acked) {
+                ++acked;
+            }
+        }
+    }
+    if (!confirmed) {
+        return -1;
+    }
+    return acked * 100 / confirmed;
+}
+
+void LinkStats::commit() {
+    records_[next_] = pending_;
+    next_ = (next_ + 1) % MAX_RECORDS;
+    if (count_ < MAX_RECORDS) {
+        ++count_;
+    }
+    hasPending_ = false;
+}
+
+LinkStatsDiagnosticData::LinkStatsDiagnosticData(const LinkStats& stats, LoRaWANDiagnosticId id, const char* name) :
+        AbstractIntegerDiagnosticData(id, name),
+        stats_(stats),
+        id_(id) {
+}
+
+int LinkStatsDiagnosticData::get(IntType& val) {
+    if (id_ == DIAG_ID_LORAWAN_UPLINKS) {
+        val = stats_.frameCount();
+        return 0;
+    }
+    if (id_ == DIAG_ID_LORAWAN_ACK_RATE) {
+        val = stats_.ackRate();
+        return (val < 0) ? SYSTEM_ERROR_NOT_FOUND : 0;
+    }
+    if (!stats_.size()) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    const auto& rec = stats_.record(0);
+    switch (id_) {
+    case DIAG_ID_LORAWAN_RSSI:
+    case DIAG_ID_LORAWAN_SNR: {
+        // Report the most recent frame that was acknowledged by a downlink
+        for (size_t i = 0; i < stats_.size(); ++i) {
+            const auto& r = stats_.record(i);
+            if (r.hasDownlink) {
+                val = (id_ == DIAG_ID_LORAWAN_RSSI) ? r.rssi : r.snr;
+                return 0;
+            }
+        }
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    case DIAG_ID_LORAWAN_DATA_RATE:
+        val = rec.dataRate;
+        return 0;
+    case DIAG_ID_LORAWAN_FREQUENCY:
+        val = rec.frequency;
+        return 0;
+    default:
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+}
+
+} // particle
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particle {
+
+// Diagnostic sources describing the LoRaWAN link, answered by getDiagnosticValue(). The IDs below
+// DIAG_ID_USER are reserved for the system
+enum LoRaWANDiagnosticId {
+    DIAG_ID_LORAWAN_RSSI = DIAG_ID_USER,                // RSSI of the last acknowledging downlink, dBm
+    DIAG_ID_LORAWAN_SNR = DIAG_ID_USER + 1,             // SNR of the last acknowledging downlink, dB
+    DIAG_ID_LORAWAN_DATA_RATE = DIAG_ID_USER + 2,       // Data rate of the last uplink
+    DIAG_ID_LORAWAN_FREQUENCY = DIAG_ID_USER + 3,       // Frequency of the last uplink, Hz
+    DIAG_ID_LORAWAN_ACK_RATE = DIAG_ID_USER + 4,        // Percentage of the recorded confirmed uplinks that were acknowledged
+    DIAG_ID_LORAWAN_UPLINKS = DIAG_ID_USER + 5          // Number of uplink frames sent since boot
+};
+
+struct LinkRecord {
+    system_tick_t time;     // Time the frame was sent, see millis()
+    uint32_t frequency;     // Frequency of the last transmission of the frame in Hz, or 0 if unknown
+    int16_t rssi;           // RSSI of the downlink that acknowledged the frame, dBm
+    int8_t snr;             // SNR of the downlink that acknowledged the frame, dB
+    int8_t dataRate;        // Data rate of the last transmission of the frame, or -1 if unknown
+    uint8_t attempts;       // Number of transmissions including retransmissions
+    bool hasDownlink;       // true if `rssi` and `snr` are valid
+    bool confirmed;         // true if an acknowledgement was requested for the frame
+    bool acked;             // true if the network acknowledged the frame
+};
+
+/**
+ * Per-frame link records collected from the module's URCs and MAC traces.
+ *
+ * The most recent `MAX_RECORDS` frames are kept in a ring buffer.
+ */
+class LinkStats {
+
+public:
+    static const size_t MAX_RECORDS = 16;
+
+    LinkStats();
+
+    void frameSent(system_tick_t time, bool confirmed);
+    void frameCancelled();
+    void transmissionStarted(uint32_t frequency, int dataRate);
+    void downlinkReceived(int rssi, int snr);
+    void frameCompleted(bool acked);
+
+    // Number of completed frames in the ring buffer
+    size_t size() const;
+    // Get a completed frame record, where index 0 is the most recent one
+    const LinkRecord& record(size_t index) const;
+
+    // Number of frames sent since boot
+    uint32_t frameCount() const;
+    // Percentage of the recorded confirmed frames that were acknowledged, or -1 if there are no such records
+    int ackRate() const;
+
+private:
+    LinkRecord records_[MAX_RECORDS];
+    LinkRecord pending_;
+    size_t next_;
+    size_t count_;
+    uint32_t frameCount_;
+    bool hasPending_;
+
+    void commit();
+};
+
+inline size_t LinkStats::size() const {
+    return count_;
+}
+
+inline const LinkRecord& LinkStats::record(size_t index) const {
+    return records_[(next_ + MAX_RECORDS - 1 - index) % MAX_RECORDS];
+}
+
+inline uint32_t LinkStats::frameCount() const {
+    return frameCount_;
+}
+
+class LinkStatsDiagnosticData: public AbstractIntegerDiagnosticData {
+
+public:
+    LinkStatsDiagnosticData(const LinkStats& stats, LoRaWANDiagnosticId id, const char* name);
+
+protected:
+    int get(IntType& val) override;
+
+private:
+    const LinkStats& stats_;
+    LoRaWANDiagnosticId id_;
+};
+
+} // particle
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lorawan_region.h"
+
+#include "system_error.h"
+
+#include <algorithm>
+
+namespace particle {
+
+namespace {
+
+// Uplink data rates as defined in the LoRaWAN Regional Parameters (RP002), with the uplink dwell time limit disabled
+
+const LoRaWANDataRate EU868_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 222 },
+    { 7, 125, 222 },
+    { 7, 250, 222 },
+    { 0, 0, 222 } // FSK 50 kbps
+};
+
+const LoRaWANDataRate US915_DATA_RATES[] = {
+    { 10, 125, 11 },
+    { 9, 125, 53 },
+    { 8, 125, 125 },
+    { 7, 125, 242 },
+    { 8, 500, 242 }
+};
+
+const LoRaWANDataRate AU915_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 242 },
+    { 7, 125, 242 },
+    { 8, 500, 242 }
+};
+
+const LoRaWANDataRate AS923_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 242 },
+    { 7, 125, 242 },
+    { 7, 250, 242 },
+    { 0, 0, 242 } // FSK 50 kbps
+};
+
+const LoRaWANDataRate KR920_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 242 },
+    { 7, 125, 242 }
+};
+
+const LoRaWANDataRate IN865_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 242 },
+    { 7, 125, 242 },
+    { 0, 0, 0 }, // RFU
+    { 0, 0, 242 } // FSK 50 kbps
+};
+
+const LoRaWANDataRate CN470_DATA_RATES[] = {
+    { 12, 125, 51 },
+    { 11, 125, 51 },
+    { 10, 125, 51 },
+    { 9, 125, 115 },
+    { 8, 125, 222 },
+    { 7, 125, 222 }
+};
+
+template<size_t N>
+const LoRaWANDataRate* findDataRate(const LoRaWANDataRate (&dataRates)[N], unsigned dataRate) {
+    if (dataRate >= N || !dataRates[dataRate].maxPayloadSize) {
+        return nullptr;
+    }
+    return &dataRates[dataRate];
+}
+
+} // namespace
+
+const LoRaWANDataRate* lorawanDataRate(LoRaWANRegion region, unsigned dataRate) {
+    switch (region) {
+    case LoRaWANRegion::EU868:
+    case LoRaWANRegion::EU433:
+    case LoRaWANRegion::CN779:
+    case LoRaWANRegion::RU864:
+        return findDataRate(EU868_DATA_RATES, dataRate);
+    case LoRaWANRegion::US915:
+        return findDataRate(US915_DATA_RATES, dataRate);
+    case LoRaWANRegion::AU915:
+        return findDataRate(AU915_DATA_RATES, dataRate);
+    case LoRaWANRegion::AS923:
+        return findDataRate(AS923_DATA_RATES, dataRate);
+    case LoRaWANRegion::KR920:
+        return findDataRate(KR920_DATA_RATES, dataRate);
+    case LoRaWANRegion::IN865:
+        return findDataRate(IN865_DATA_RATES, dataRate);
+    case LoRaWANRegion::CN470:
+        return findDataRate(CN470_DATA_RATES, dataRate);
+    default:
+        return nullptr;
+    }
+}
+
+int lorawanMaxAppPayloadSize(LoRaWANRegion region, unsigned dataRate) {
+    auto dr = lorawanDataRate(region, dataRate);
+    if (!dr) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+    size_t size = dr->maxPayloadSize;
+    return size - std::min(size / 2, LORAWAN_MAX_FOPTS_SIZE);
+}
+
+} // particle
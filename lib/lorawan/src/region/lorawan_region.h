@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particle {
+
+// Regions as numbered by the AT+QBAND command
+enum class LoRaWANRegion: uint8_t {
+    AS923 = 0,
+    AU915 = 1,
+    CN470 = 2,
+    CN779 = 3,
+    EU433 = 4,
+    EU868 = 5,
+    KR920 = 6,
+    IN865 = 7,
+    US915 = 8,
+    RU864 = 9
+};
+
+// Maximum size of the FOpts field that carries piggybacked MAC commands
+const size_t LORAWAN_MAX_FOPTS_SIZE = 15;
+
+struct LoRaWANDataRate {
+    uint8_t spreadingFactor;    // 0 if the data rate uses FSK modulation
+    uint16_t bandwidth;         // Bandwidth in kHz
+    uint8_t maxPayloadSize;     // Maximum FRMPayload size when FOpts is empty (N)
+};
+
+/**
+ * Get the parameters of an uplink data rate.
+ *
+ * @param region Region.
+ * @param dataRate Data rate.
+ * @return Data rate parameters, or `nullptr` if the data rate is not defined for uplinks in the region.
+ */
+const LoRaWANDataRate* lorawanDataRate(LoRaWANRegion region, unsigned dataRate);
+
+/**
+ * Get the maximum size of the application payload that can be sent at a given data rate.
+ *
+ * Some room is reserved for the MAC commands that the stack may piggyback in the FOpts field of
+ * an uplink, but never more than half of the frame so that the slowest data rates remain usable.
+ *
+ * @param region Region.
+ * @param dataRate Data rate.
+ * @return Payload size, or an error code.
+ */
+int lorawanMaxAppPayloadSize(LoRaWANRegion region, unsigned dataRate);
+
+} // particle
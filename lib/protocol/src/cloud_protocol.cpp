@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
 
 #include <pb_encode.h>
 #include <pb_decode.h>
@@ -13,13 +15,12 @@
 #include <cloud/cloud_new.pb.h>
 
 #include "util/protobuf.h"
+#include "util/compression.h"
+#include "util/bit_packing.h"
 #include "cloud_protocol.h"
 
 #include "diag_query/diag_query.h"
 
-#include <vector>
-#include <map>
-
 #define PB_CLOUD(_name) particle_cloud_##_name
 
 namespace particle::constrained {
@@ -29,7 +30,168 @@ namespace {
 enum RequestType {
     HELLO = 1,
     EVENT = 2,
-    DIAGNOSTICS = 3
+    DIAGNOSTICS = 3,
+    // Sequence of events, each encoded as a varint containing the age of the event in seconds,
+    // followed by a varint containing the size of the EventRequest message and the message itself
+    EVENT_BATCH = 4,
+    // Set of event codes the device is subscribed to. This is the part of the application description
+    // selected by APP_FLAG_CONSTRAINED_SUBSCRIPTIONS, sent whenever it changes. The codes are encoded as
+    // a sequence of ranges in ascending order, each encoded as a varint containing the difference between
+    // the first code of the range and the end of the previous range, followed by a varint containing the
+    // number of codes in the range minus one. An empty payload means there are no subscriptions
+    SUBSCRIPTIONS = 5,
+    // Sent by the cloud to query the description of the device
+    DESCRIPTION = 6
+};
+
+// Flags combined with the request type
+enum RequestFlag {
+    // The payload is compressed with util::compress()
+    COMPRESSED = 0x40
+};
+
+const unsigned REQUEST_TYPE_MASK = 0x1f;
+
+// Maximum number of events sent in a single batch
+const size_t MAX_BATCH_EVENTS = 16;
+
+// Number of times a Hello request is sent again if the cloud doesn't respond
+const unsigned HELLO_MAX_RETRIES = 3;
+
+// Delay before sending the Hello again after a failed attempt. Doubled after every failure
+const system_tick_t HELLO_RETRY_DELAY = 10000;
+const system_tick_t MAX_HELLO_RETRY_DELAY = 600000;
+
+// Number of times a Subscriptions request is sent again if the cloud doesn't respond
+const unsigned SUBSCRIPTIONS_MAX_RETRIES = 3;
+
+// Delay before sending the subscriptions again after a failed attempt. Doubled after every failure
+const system_tick_t SUBSCRIPTIONS_RETRY_DELAY = 60000;
+const system_tick_t MAX_SUBSCRIPTIONS_RETRY_DELAY = 3600000;
+
+// Application description flags that select the subscriptions. The device only has constrained
+// subscriptions and no legacy functions or variables
+const uint32_t APP_FLAGS_SUBSCRIPTIONS = PB_CLOUD(DescriptionRequest_AppFlag_APP_FLAG_SUBSCRIPTIONS) |
+        PB_CLOUD(DescriptionRequest_AppFlag_APP_FLAG_CONSTRAINED_SUBSCRIPTIONS);
+
+// Maximum number of diagnostic sources that can be queried in a single request
+const size_t MAX_DIAG_SOURCES = 16;
+
+// The Diagnostics response is encoded into a single block of the buffer pool
+const size_t MAX_DIAGNOSTICS_RESPONSE_SIZE = util::Buffer::POOL_BLOCK_SIZE - MAX_FRAME_HEADER_SIZE;
+
+// Maximum size of an encoded DiagnosticsResponse.Source: tag, length, ID field and data field
+const size_t MAX_DIAG_SOURCE_SIZE = 2 + 6 + 2 + DIAG_VALUE_SIZE;
+
+static_assert(MAX_DIAG_SOURCES * MAX_DIAG_SOURCE_SIZE <= MAX_DIAGNOSTICS_RESPONSE_SIZE,
+        "Diagnostics response may not fit in the buffer");
+
+// Maximum number of fields of a bit-packed event
+const size_t MAX_PACKED_FIELDS = 16;
+
+size_t varintSize(uint64_t val) {
+    size_t n = 1;
+    while (val >>= 7) {
+        ++n;
+    }
+    return n;
+}
+
+// Append a length-delimited protobuf field
+int encodeBytesField(util::Buffer& buf, unsigned fieldNum, const char* data, size_t size) {
+    CHECK(util::encodeVarint(buf, (fieldNum << 3) | PB_WT_STRING));
+    CHECK(util::encodeVarint(buf, size));
+    CHECK(buf.resize(buf.size() + size));
+    std::memcpy(buf.data() + buf.size() - size, data, size);
+    return 0;
+}
+
+// Event data encoded by the EventRequest.data callback
+struct EventData {
+    const char* data; // CBOR or bit-packed data
+    size_t size;
+};
+
+// Appends the bytes written to it to a buffer
+class OutputBufferStream: public Stream {
+public:
+    explicit OutputBufferStream(util::Buffer& buf) :
+            buf_(buf) {
+    }
+
+    int read() override {
+        return -1;
+    }
+
+    int available() override {
+        return 0;
+    }
+
+    int peek() override {
+        return -1;
+    }
+
+    size_t write(uint8_t b) override {
+        return write(&b, 1);
+    }
+
+    size_t write(const uint8_t* data, size_t size) override {
+        if (buf_.resize(buf_.size() + size) < 0) {
+            setWriteError(Error::NO_MEMORY);
+            return 0;
+        }
+        std::memcpy(buf_.data() + buf_.size() - size, data, size);
+        return size;
+    }
+
+    void flush() override {
+    }
+
+private:
+    util::Buffer& buf_;
+};
+
+int packEventData(util::Buffer& buf, const Variant& data, const util::PackedField* fields, size_t fieldCount) {
+    double values[MAX_PACKED_FIELDS] = {};
+    for (size_t i = 0; i < fieldCount; ++i) {
+        auto v = data.get(fields[i].name());
+        if (!v.isNumber()) {
+            Log.error("Missing or invalid event field: %s", fields[i].name());
+            return Error::BAD_DATA;
+        }
+        values[i] = v.toDouble();
+    }
+    CHECK(util::packFields(buf, fields, fieldCount, values));
+    return 0;
+}
+
+int unpackEventData(Variant& data, const util::Buffer& buf, const util::PackedField* fields, size_t fieldCount) {
+    double values[MAX_PACKED_FIELDS] = {};
+    CHECK(util::unpackFields(buf.data(), buf.size(), fields, fieldCount, values));
+    for (size_t i = 0; i < fieldCount; ++i) {
+        Variant v;
+        if (fields[i].isInteger()) {
+            v = (int64_t)std::llround(values[i]);
+        } else {
+            v = values[i];
+        }
+        if (!data.set(fields[i].name(), std::move(v))) {
+            return Error::NO_MEMORY;
+        }
+    }
+    return 0;
+}
+
+// IDs of the diagnostic sources requested by the cloud
+struct DiagnosticsQuery {
+    uint32_t ids[MAX_DIAG_SOURCES];
+    size_t count;
+    bool truncated; // Set if the request contained more IDs than can be stored
+};
+
+struct DiagnosticValue {
+    uint8_t data[DIAG_VALUE_SIZE];
+    size_t size;
 };
 
 class InputBufferStream: public Stream {
@@ -88,10 +250,12 @@ int CloudProtocol::init(CloudProtocolConfig conf) {
     }
     MessageChannelConfig chanConf;
     chanConf.onSend(conf.onSend_);
+    chanConf.timeOnAir(conf.timeOnAir_);
     chanConf.onRequest([this](auto type, auto data, auto onResp) {
         return receiveRequest(type, std::move(data), std::move(onResp));
     });
     CHECK(channel_.init(std::move(chanConf)));
+    conf_ = std::move(conf);
     state_ = State::DISCONNECTED;
     return 0;
 }
@@ -104,7 +268,13 @@ int CloudProtocol::connect() {
         return Error::INVALID_STATE;
     }
     state_ = State::CONNECTED;
-    // TODO: Send a subscription request
+    // The Hello is sent from run() so that a busy channel doesn't fail the connection
+    helloPending_ = true;
+    helloSent_ = false;
+    helloRetryDelay_ = 0;
+    // Retry sending the subscriptions if the cloud didn't acknowledge them in the previous session
+    sentSubscrsRev_ = syncedSubscrsRev_;
+    subscrsRetryDelay_ = 0;
     return 0;
 }
 
@@ -114,6 +284,11 @@ void CloudProtocol::disconnect() {
     }
     state_ = State::DISCONNECTED;
     channel_.reset();
+    decltype(batch_) batch;
+    using std::swap;
+    swap(batch, batch_);
+    batchSize_ = 0;
+    cancelBatch(batch, Error::CANCELLED);
 }
 
 int CloudProtocol::receive(util::Buffer data, int port) {
@@ -121,38 +296,376 @@ int CloudProtocol::receive(util::Buffer data, int port) {
     return 0;
 }
 
+int CloudProtocol::changeMaxPayloadSize(size_t size) {
+    CHECK(channel_.changeMaxPayloadSize(size));
+    return 0;
+}
+
 int CloudProtocol::run() {
+    if (!batch_.isEmpty() && millis() - batchTime_ >= conf_.batchWindow_ && state_ == State::CONNECTED) {
+        flushBatch(); // Errors are reported to the acknowledgement handlers of the events
+    }
+    if (state_ == State::CONNECTED) {
+        sendHello(); // Errors are logged by the function
+        // Sending the subscriptions from here collects the changes made by multiple subscribe() calls
+        sendSubscriptions(); // Errors are logged by the function
+    }
     CHECK(channel_.run());
     return 0;
 }
 
 int CloudProtocol::subscribe(int code, OnEvent onEvent) {
-    if (!subscrs_.set(code, std::move(onEvent))) {
+    CHECK(addSubscription(code, Subscription{ std::move(onEvent), nullptr /* onEncodedEvent */ }));
+    return 0;
+}
+
+int CloudProtocol::subscribeEncoded(int code, OnEncodedEvent onEvent) {
+    CHECK(addSubscription(code, Subscription{ nullptr /* onEvent */, std::move(onEvent) }));
+    return 0;
+}
+
+int CloudProtocol::addSubscription(int code, Subscription subscr) {
+    if (code < 0) {
+        return Error::INVALID_ARGUMENT;
+    }
+    const bool isNew = subscrs_.find(code) == subscrs_.end();
+    if (!subscrs_.set(code, std::move(subscr))) {
         return Error::NO_MEMORY;
     }
-    // TODO: Send a subscription request
+    if (isNew) {
+        ++subscrsRev_; // The subscriptions will be sent to the cloud from run()
+    }
+    return 0;
+}
+
+int CloudProtocol::sendSubscriptions() {
+    // The cloud may not accept other requests until it has processed the Hello
+    if (state_ != State::CONNECTED || helloPending_ || subscrsReqPending_ || sentSubscrsRev_ == subscrsRev_) {
+        return 0;
+    }
+    if (subscrsRetryDelay_ && millis() - subscrsRetryTime_ < subscrsRetryDelay_) {
+        return 0;
+    }
+    util::Buffer data;
+    CHECK(data.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    CHECK(encodeSubscriptions(data));
+    const auto rev = subscrsRev_;
+    Log.trace("Sending Subscriptions request");
+    int r = channel_.sendRequest(RequestType::SUBSCRIPTIONS, std::move(data), [this, rev](auto err, auto result, auto /* data */) {
+        subscrsReqPending_ = false;
+        if (err < 0) {
+            Log.error("Failed to send Subscriptions request: %d", err);
+        } else if (result != 0) {
+            Log.error("Subscriptions request failed: %d", result);
+        } else {
+            Log.trace("Received Subscriptions response");
+            syncedSubscrsRev_ = rev;
+            subscrsRetryDelay_ = 0;
+            return 0;
+        }
+        sentSubscrsRev_ = syncedSubscrsRev_;
+        delaySubscriptions();
+        return 0;
+    }, RequestOptions().maxRetries(SUBSCRIPTIONS_MAX_RETRIES));
+    if (r < 0) {
+        Log.error("Failed to send Subscriptions request: %d", r);
+        delaySubscriptions();
+        return r;
+    }
+    sentSubscrsRev_ = rev;
+    subscrsReqPending_ = true;
     return 0;
 }
 
-int CloudProtocol::publishImpl(int code, std::optional<Variant> data) {
-    String eventData;
+void CloudProtocol::delaySubscriptions() {
+    subscrsRetryDelay_ = subscrsRetryDelay_ ? std::min(subscrsRetryDelay_ * 2, MAX_SUBSCRIPTIONS_RETRY_DELAY) :
+            SUBSCRIPTIONS_RETRY_DELAY;
+    subscrsRetryTime_ = millis();
+}
+
+int CloudProtocol::encodeSubscriptions(util::Buffer& data) {
+    Vector<unsigned> codes;
+    CHECK(getSubscribedCodes(codes));
+    unsigned prevEnd = 0; // Code following the end of the previous range
+    int i = 0;
+    while (i < codes.size()) {
+        const unsigned first = codes[i];
+        int n = 1;
+        while (i + n < codes.size() && codes[i + n] == first + n) {
+            ++n;
+        }
+        CHECK(util::encodeVarint(data, first - prevEnd));
+        CHECK(util::encodeVarint(data, n - 1));
+        prevEnd = first + n;
+        i += n;
+    }
+    return 0;
+}
+
+int CloudProtocol::setPackedEncoding(int code, const util::PackedField* fields, size_t fieldCount) {
+    if (fieldCount > MAX_PACKED_FIELDS) {
+        return Error::TOO_LARGE;
+    }
+    if (!packedEncs_.set(code, PackedEncoding{ fields, fieldCount })) {
+        return Error::NO_MEMORY;
+    }
+    return 0;
+}
+
+int CloudProtocol::getSubscribedCodes(Vector<unsigned>& codes) const {
+    if (!codes.reserve(subscrs_.size())) {
+        return Error::NO_MEMORY;
+    }
+    for (auto& [code, subscr]: subscrs_) {
+        codes.append(code);
+    }
+    std::sort(codes.begin(), codes.end());
+    return 0;
+}
+
+int CloudProtocol::sendHello() {
+    if (state_ != State::CONNECTED || !helloPending_ || helloSent_) {
+        return 0;
+    }
+    if (helloRetryDelay_ && millis() - helloRetryTime_ < helloRetryDelay_) {
+        return 0;
+    }
+    int r = sendHelloRequest();
+    if (r < 0) {
+        Log.error("Failed to send Hello request: %d", r);
+        delayHello();
+        return r;
+    }
+    helloSent_ = true;
+    return 0;
+}
+
+void CloudProtocol::delayHello() {
+    helloRetryDelay_ = helloRetryDelay_ ? std::min(helloRetryDelay_ * 2, MAX_HELLO_RETRY_DELAY) : HELLO_RETRY_DELAY;
+    helloRetryTime_ = millis();
+}
+
+int CloudProtocol::sendHelloRequest() {
+    // The descriptions are only sent if the cloud requests them after receiving their hashes
+    CHECK(updateSystemDescription());
+    CHECK(updateAppDescription());
+    PB_CLOUD(HelloRequest) reqMsg = {};
+    reqMsg.system_version = conf_.systemVersion_;
+    if (conf_.productVersion_.has_value()) {
+        reqMsg.has_product_version = true;
+        reqMsg.product_version = conf_.productVersion_.value();
+    }
+    static_assert(sizeof(reqMsg.system_description_hash.bytes) == util::Sha1::HASH_SIZE &&
+            sizeof(reqMsg.app_description_hash.bytes) == util::Sha1::HASH_SIZE);
+    std::memcpy(reqMsg.system_description_hash.bytes, sysDesc_.hash, util::Sha1::HASH_SIZE);
+    reqMsg.system_description_hash.size = util::Sha1::HASH_SIZE;
+    std::memcpy(reqMsg.app_description_hash.bytes, appDesc_.hash, util::Sha1::HASH_SIZE);
+    reqMsg.app_description_hash.size = util::Sha1::HASH_SIZE;
+    reqMsg.has_app_description_hash = true;
+    util::Buffer data;
+    CHECK(data.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    CHECK(util::encodeProtobuf(data, &reqMsg, &PB_CLOUD(HelloRequest_msg)));
+    Log.trace("Sending Hello request");
+    CHECK(channel_.sendRequest(RequestType::HELLO, std::move(data), [this](auto err, auto result, auto data) {
+        if (err < 0 || result != 0) {
+            if (err < 0) {
+                Log.error("Failed to send Hello request: %d", err);
+            } else {
+                Log.error("Hello request failed: %d", result);
+            }
+            // Send the Hello again from run()
+            helloSent_ = false;
+            delayHello();
+            return 0;
+        }
+        helloPending_ = false;
+        helloRetryDelay_ = 0;
+        PB_CLOUD(HelloResponse) respMsg = {};
+        int r = util::decodeProtobuf(data, &respMsg, &PB_CLOUD(HelloResponse_msg));
+        if (r < 0) {
+            Log.error("Failed to parse Hello response: %d", r);
+            return 0;
+        }
+        Log.trace("Received Hello response");
+        if (respMsg.flags & PB_CLOUD(HelloResponse_Flag_FLAG_UPDATE_PENDING)) {
+            Log.info("Firmware update is pending");
+        }
+        return 0;
+    }, RequestOptions().maxRetries(HELLO_MAX_RETRIES)));
+    return 0;
+}
+
+int CloudProtocol::updateSystemDescription() {
+    if (sysDesc_.rev) {
+        return 0; // The system description doesn't change at run time
+    }
+    PB_CLOUD(FirmwareModule) moduleMsg = {};
+    moduleMsg.type = PB_CLOUD(FirmwareModuleType_SYSTEM_PART_MODULE);
+    moduleMsg.index = 1;
+    moduleMsg.version = conf_.systemVersion_;
+    moduleMsg.store = PB_CLOUD(FirmwareModuleStore_MAIN_MODULE_STORE);
+    PB_CLOUD(SystemDescribe) descMsg = {};
+    descMsg.firmware_modules.arg = &moduleMsg;
+    descMsg.firmware_modules.funcs.encode = [](auto strm, auto field, auto arg) {
+        return pb_encode_tag_for_field(strm, field) && pb_encode_submessage(strm, &PB_CLOUD(FirmwareModule_msg), *arg);
+    };
+    util::Buffer data;
+    CHECK(util::encodeProtobuf(data, &descMsg, &PB_CLOUD(SystemDescribe_msg)));
+    util::Sha1 sha;
+    sha.update(data.data(), data.size());
+    sha.finish(sysDesc_.hash);
+    sysDesc_.data = std::move(data);
+    sysDesc_.rev = 1;
+    return 0;
+}
+
+int CloudProtocol::updateAppDescription() {
+    if (appDesc_.rev == subscrsRev_) {
+        return 0;
+    }
+    Vector<unsigned> codes;
+    CHECK(getSubscribedCodes(codes));
+    PB_CLOUD(DescriptionResponse_AppDescription) descMsg = {};
+    descMsg.subscriptions.arg = &codes;
+    descMsg.subscriptions.funcs.encode = [](auto strm, auto field, auto arg) {
+        auto codes = (const Vector<unsigned>*)*arg;
+        for (auto code: *codes) {
+            // A constrained subscription is identified by the event code
+            char prefix[16] = {};
+            snprintf(prefix, sizeof(prefix), "%u", code);
+            PB_CLOUD(DescriptionResponse_AppDescription_Subscription) subscrMsg = {};
+            subscrMsg.constrained = true;
+            subscrMsg.prefix.arg = prefix;
+            subscrMsg.prefix.funcs.encode = [](auto strm, auto field, auto arg) {
+                auto str = (const char*)*arg;
+                return pb_encode_tag_for_field(strm, field) && pb_encode_string(strm, (const pb_byte_t*)str, std::strlen(str));
+            };
+            if (!pb_encode_tag_for_field(strm, field) ||
+                    !pb_encode_submessage(strm, &PB_CLOUD(DescriptionResponse_AppDescription_Subscription_msg), &subscrMsg)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    util::Buffer data;
+    CHECK(util::encodeProtobuf(data, &descMsg, &PB_CLOUD(DescriptionResponse_AppDescription_msg)));
+    util::Sha1 sha;
+    sha.update(data.data(), data.size());
+    sha.finish(appDesc_.hash);
+    appDesc_.data = std::move(data);
+    appDesc_.rev = subscrsRev_;
+    return 0;
+}
+
+int CloudProtocol::encodeDescriptionResponse(uint32_t systemFlags, uint32_t appFlags) {
+    // The response is assembled from the encoded descriptions instead of encoding the message again.
+    // The system description is small, so it's sent in full if any part of it is requested
+    const bool withSubscrs = appFlags & APP_FLAGS_SUBSCRIPTIONS;
+    util::Buffer data;
+    CHECK(data.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    if (systemFlags) {
+        CHECK(encodeBytesField(data, PB_CLOUD(DescriptionResponse_system_description_tag), sysDesc_.data.data(),
+                sysDesc_.data.size()));
+    }
+    if (appFlags) {
+        // An empty AppDescription is sent if only legacy functions or variables are requested
+        CHECK(encodeBytesField(data, PB_CLOUD(DescriptionResponse_app_description_tag), appDesc_.data.data(),
+                withSubscrs ? appDesc_.data.size() : 0));
+    }
+    // The hashes are only included for the descriptions that are sent in full
+    if (systemFlags) {
+        CHECK(encodeBytesField(data, PB_CLOUD(DescriptionResponse_system_description_hash_tag), sysDesc_.hash,
+                sizeof(sysDesc_.hash)));
+    }
+    if (withSubscrs) {
+        CHECK(encodeBytesField(data, PB_CLOUD(DescriptionResponse_app_description_hash_tag), appDesc_.hash,
+                sizeof(appDesc_.hash)));
+    }
+    // The cached response is shared with the message channel, which keeps it for retransmitted requests
+    // and block-wise transfers, instead of being copied for every request
+    CHECK(data.share());
+    descResp_.data = std::move(data);
+    descResp_.systemFlags = systemFlags;
+    descResp_.appFlags = appFlags;
+    descResp_.appRev = appDesc_.rev;
+    return 0;
+}
+
+int CloudProtocol::publishImpl(int code, const Variant* data, const char* encodedData, size_t encodedSize,
+        PublishOptions opts) {
+    if (state_ != State::CONNECTED) {
+        // Batched events would pile up while disconnected
+        return Error::INVALID_STATE;
+    }
+    // The size of the event data needs to be known before the EventRequest message is encoded, so the data is
+    // encoded once into a buffer that usually fits a block of the pool and then copied into the message
+    util::Buffer encoded;
+    if (data) {
+        auto it = packedEncs_.find(code);
+        if (it != packedEncs_.end()) {
+            CHECK(packEventData(encoded, *data, it->second.fields, it->second.fieldCount));
+        } else {
+            CHECK(encoded.reserve(util::Buffer::POOL_BLOCK_SIZE));
+            OutputBufferStream s(encoded);
+            CHECK(encodeToCBOR(*data, s));
+            CHECK(s.getWriteError());
+        }
+        encodedData = encoded.data();
+        encodedSize = encoded.size();
+    }
     PB_CLOUD(EventRequest) reqMsg = {};
     reqMsg.which_type = PB_CLOUD(EventRequest_code_tag);
     reqMsg.type.code = code;
-    if (data.has_value()) {
-        OutputStringStream s(eventData);
-        CHECK(encodeToCBOR(data.value(), s));
+    EventData eventData = {};
+    if (encodedData) {
+        eventData.data = encodedData;
+        eventData.size = encodedSize;
         reqMsg.data.arg = &eventData;
         reqMsg.data.funcs.encode = [](auto strm, auto field, auto arg) {
-            auto eventData = (const String*)*arg;
+            auto eventData = (const EventData*)*arg;
             return pb_encode_tag_for_field(strm, field) &&
-                    pb_encode_string(strm, (const uint8_t*)eventData->c_str(), eventData->length());
+                    pb_encode_string(strm, (const pb_byte_t*)eventData->data, eventData->size);
         };
     }
+    if (!opts.onAck() && opts.confirmed()) {
+        opts.onAck([code](int error) {
+            if (error < 0) {
+                Log.warn("Event was not acknowledged by the network, code: %d", code);
+            }
+        });
+    }
+    if (conf_.batchWindow_) {
+        util::Buffer msg;
+        CHECK(util::encodeProtobuf(msg, &reqMsg, &PB_CLOUD(EventRequest_msg)));
+        CHECK(addToBatch(std::move(msg), std::move(opts)));
+        return 0;
+    }
+
     util::Buffer reqData;
+    CHECK(reqData.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
     CHECK(util::encodeProtobuf(reqData, &reqMsg, &PB_CLOUD(EventRequest_msg)));
+    auto reqOpts = RequestOptions().confirmed(opts.confirmed()).noResponse(opts.noResponse()).maxRetries(opts.maxRetries());
+    if (opts.onAck()) {
+        reqOpts.onAck(opts.onAck());
+    }
     Log.trace("Sending Event request");
-    CHECK(channel_.sendRequest(RequestType::EVENT, std::move(reqData), [](auto err, auto result, auto /* data */) {
+    CHECK(sendEventRequest(RequestType::EVENT, std::move(reqData), opts.compressed(), std::move(reqOpts)));
+    return 0;
+}
+
+int CloudProtocol::sendEventRequest(unsigned type, util::Buffer data, bool compressed, RequestOptions opts) {
+    if (compressed) {
+        util::Buffer buf;
+        CHECK(buf.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+        CHECK(util::compress(buf, data.data(), data.size()));
+        // Keep the original data if it doesn't compress well
+        if (buf.size() < data.size()) {
+            Log.trace("Compressed event data: %u -> %u bytes", (unsigned)data.size(), (unsigned)buf.size());
+            data = std::move(buf);
+            type |= RequestFlag::COMPRESSED;
+        }
+    }
+    CHECK(channel_.sendRequest(type, std::move(data), [](auto err, auto result, auto /* data */) {
         if (err < 0) {
             Log.error("Failed to send Event request: %d", err);
         } else {
@@ -162,11 +675,108 @@ int CloudProtocol::publishImpl(int code, std::optional<Variant> data) {
             }
         }
         return 0;
-    }));
+    }, std::move(opts)));
     return 0;
 }
 
+int CloudProtocol::addToBatch(util::Buffer msg, PublishOptions opts) {
+    // The age of an event grows while it waits in the batch
+    const uint64_t maxAge = conf_.batchWindow_ / 1000 + 1;
+    const size_t size = varintSize(maxAge) + varintSize(msg.size()) + msg.size();
+    const size_t maxSize = channel_.maxPayloadSize() - MAX_FRAME_HEADER_SIZE;
+    if (!batch_.isEmpty() && (batchSize_ + size > maxSize || (size_t)batch_.size() >= MAX_BATCH_EVENTS)) {
+        CHECK(flushBatch());
+    }
+    if (batch_.isEmpty()) {
+        batchTime_ = millis();
+        batchSize_ = 0;
+    }
+    if (!batch_.append(BatchedEvent{ std::move(msg), std::move(opts), millis() })) {
+        return Error::NO_MEMORY;
+    }
+    batchSize_ += size;
+    if (batchSize_ >= maxSize) {
+        CHECK(flushBatch()); // The event doesn't leave room for another one
+    }
+    return 0;
+}
+
+int CloudProtocol::flushBatch() {
+    if (batch_.isEmpty()) {
+        return 0;
+    }
+    util::Buffer data;
+    CHECK(data.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    decltype(batch_) batch;
+    using std::swap;
+    swap(batch, batch_);
+    batchSize_ = 0;
+
+    // The batch is confirmed, compressed, etc. if any of its events requires that
+    const auto now = millis();
+    bool confirmed = false;
+    bool compressed = false;
+    bool noResp = true;
+    unsigned maxRetries = 0;
+    Vector<MessageChannel::OnAck> acks;
+    int r = 0;
+    for (auto& e: batch) {
+        const uint64_t age = (now - e.time) / 1000;
+        r = util::encodeVarint(data, age);
+        if (r >= 0) {
+            r = util::encodeVarint(data, e.data.size());
+        }
+        if (r >= 0) {
+            r = data.resize(data.size() + e.data.size());
+        }
+        if (r < 0) {
+            break;
+        }
+        std::memcpy(data.data() + data.size() - e.data.size(), e.data.data(), e.data.size());
+        confirmed |= e.opts.confirmed();
+        compressed |= e.opts.compressed();
+        noResp &= e.opts.noResponse();
+        maxRetries = std::max(maxRetries, e.opts.maxRetries());
+        if (e.opts.onAck() && !acks.append(e.opts.onAck())) {
+            r = Error::NO_MEMORY;
+            break;
+        }
+    }
+    if (r >= 0) {
+        auto reqOpts = RequestOptions().confirmed(confirmed).noResponse(noResp).maxRetries(maxRetries);
+        if (!acks.isEmpty()) {
+            reqOpts.onAck([acks = std::move(acks)](int error) {
+                for (auto& onAck: acks) {
+                    onAck(error);
+                }
+            });
+        }
+        Log.trace("Sending Event request with %d events", batch.size());
+        r = sendEventRequest(RequestType::EVENT_BATCH, std::move(data), compressed, std::move(reqOpts));
+    }
+    if (r < 0) {
+        Log.error("Failed to send batched events: %d", r);
+        cancelBatch(batch, r);
+        return r;
+    }
+    return 0;
+}
+
+void CloudProtocol::cancelBatch(Vector<BatchedEvent>& batch, int error) {
+    for (auto& e: batch) {
+        if (e.opts.onAck()) {
+            e.opts.onAck()(error);
+        }
+    }
+}
+
 int CloudProtocol::receiveRequest(unsigned type, util::Buffer data, MessageChannel::OnResponse onResp) {
+    if (type & RequestFlag::COMPRESSED) {
+        util::Buffer buf;
+        CHECK(util::decompress(buf, data.data(), data.size(), MessageChannel::MAX_BLOCKWISE_MESSAGE_SIZE));
+        data = std::move(buf);
+    }
+    type &= REQUEST_TYPE_MASK;
     switch (type) {
     case RequestType::EVENT: {
         CHECK(receiveEventRequest(std::move(data), std::move(onResp)));
@@ -176,6 +786,10 @@ int CloudProtocol::receiveRequest(unsigned type, util::Buffer data, MessageChann
         CHECK(receiveDiagnosticsRequest(std::move(data), std::move(onResp)));
         break;
     }
+    case RequestType::DESCRIPTION: {
+        CHECK(receiveDescriptionRequest(std::move(data), std::move(onResp)));
+        break;
+    }
     default:
         Log.error("Received unsupported request, type: %u", type);
     }
@@ -200,10 +814,25 @@ int CloudProtocol::receiveEventRequest(util::Buffer data, MessageChannel::OnResp
         return Error::NOT_SUPPORTED;
     }
     auto code = reqMsg.type.code;
-    Variant v;
-    InputBufferStream strm(buf);
-    CHECK(decodeFromCBOR(v, strm));
     Log.trace("Received event, code: %d", (int)code);
+    auto it = subscrs_.find(code);
+    if (it != subscrs_.end() && it->second.onEncodedEvent) {
+        // The data is encoded with an EventSchema
+        onResp(0 /* error */, 0 /* result */, util::Buffer());
+        int r = it->second.onEncodedEvent(code, buf.data(), buf.size());
+        if (r < 0) {
+            Log.error("Failed to decode event data: %d", r);
+        }
+        return 0;
+    }
+    Variant v;
+    auto packedIt = packedEncs_.find(code);
+    if (packedIt != packedEncs_.end()) {
+        CHECK(unpackEventData(v, buf, packedIt->second.fields, packedIt->second.fieldCount));
+    } else {
+        InputBufferStream strm(buf);
+        CHECK(decodeFromCBOR(v, strm));
+    }
     if (buf.size() > 0) {
         Log.print(LOG_LEVEL_TRACE, v.toJSON().c_str());
         Log.print(LOG_LEVEL_TRACE, "\r\n");
@@ -211,159 +840,97 @@ int CloudProtocol::receiveEventRequest(util::Buffer data, MessageChannel::OnResp
     // Send a response
     onResp(0 /* error */, 0 /* result */, util::Buffer());
     // Invoke the subscription handler
-    auto it = subscrs_.find(code);
     if (it == subscrs_.end()) {
         Log.warn("Missing subscription handler");
         return 0;
     }
-    it->second(code, std::move(v));
+    it->second.onEvent(code, std::move(v));
     return 0;
 }
 
-
-struct EncodedUint8Bytes {
-    const uint8_t* data;
-    size_t size;
-
-    explicit EncodedUint8Bytes(pb_callback_t* cb, const uint8_t* data = nullptr, size_t size = 0) :
-            data(data),
-            size(size) {
-        cb->arg = this;
-        cb->funcs.encode = [](pb_ostream_t* strm, const pb_field_iter_t* field, void* const* arg) {
-            const auto str = (const EncodedUint8Bytes*)*arg;
-            if (str->data && str->size > 0 && (!pb_encode_tag_for_field(strm, field) ||
-                    !pb_encode_string(strm, (const uint8_t*)str->data, str->size))) {
-                return false;
-            }
-            return true;
-        };
+int CloudProtocol::receiveDescriptionRequest(util::Buffer data, MessageChannel::OnResponse onResp) {
+    PB_CLOUD(DescriptionRequest) reqMsg = {};
+    CHECK(decodeProtobuf(data, &reqMsg, &PB_CLOUD(DescriptionRequest_msg)));
+    const uint32_t systemFlags = reqMsg.has_system_flags ? reqMsg.system_flags : 0;
+    const uint32_t appFlags = reqMsg.has_app_flags ? reqMsg.app_flags : 0;
+    Log.trace("Received Description request, system flags: 0x%08x, app flags: 0x%08x", (unsigned)systemFlags,
+            (unsigned)appFlags);
+    CHECK(updateSystemDescription());
+    CHECK(updateAppDescription());
+    // The cloud usually requests the same parts of the description, so only the last response is cached
+    if (!descResp_.appRev || descResp_.systemFlags != systemFlags || descResp_.appFlags != appFlags ||
+            descResp_.appRev != appDesc_.rev) {
+        CHECK(encodeDescriptionResponse(systemFlags, appFlags));
     }
-};
+    // Responses that don't fit in a frame are sent in blocks by the message channel
+    onResp(0 /* error */, 0 /* result */, descResp_.data);
+    return 0;
+}
 
-bool encodeDiagMap(pb_ostream_t *stream, const pb_field_t *field, void* const* arg) {
-    auto map = (const std::map<uint32_t, std::vector<uint8_t>>*)*arg;
-    for (const auto& val : *map) {
-
-        const uint32_t id = val.first;
-        // Log.printf("Logging values[%d]: ", id);
-
-        // uint8_t bytes[4] = {0};
-        // memcpy(bytes, val.second.data(), sizeof(bytes));
-        // for (int i=0; i<val.second.size(); i++) {
-        //     Log.printf("%02X", bytes[i]);
-        // }
-        // Log.print("\r\n");
-        
-        PB_CLOUD(DiagnosticsResponse_Source) s = PB_CLOUD(DiagnosticsResponse_Source_init_default);
-        s.id = id;
-        EncodedUint8Bytes myDataBytes(&s.data, (uint8_t*)val.second.data(), val.second.size());
-        if (!pb_encode_tag_for_field(stream, field)) {
-            Log.print(LOG_LEVEL_TRACE, "Tag encoding failed\r\n");
+int CloudProtocol::receiveDiagnosticsRequest(util::Buffer data, MessageChannel::OnResponse onResp) {
+    // Parse the request
+    DiagnosticsQuery query = {};
+    PB_CLOUD(DiagnosticsRequest) reqMsg = {};
+    reqMsg.ids.arg = &query;
+    reqMsg.ids.funcs.decode = [](auto strm, auto field, auto arg) {
+        auto query = (DiagnosticsQuery*)*arg;
+        uint32_t id = 0;
+        if (!pb_decode_varint32(strm, &id)) {
             return false;
         }
-
-        if (!pb_encode_submessage(stream, particle_cloud_DiagnosticsResponse_Source_fields, &s)) {
-            Log.print(LOG_LEVEL_TRACE, "Encoding failed\r\n");
-            return false;
+        if (query->count < MAX_DIAG_SOURCES) {
+            query->ids[query->count++] = id;
+        } else {
+            query->truncated = true;
         }
+        return true;
+    };
+    CHECK(decodeProtobuf(data, &reqMsg, &PB_CLOUD(DiagnosticsRequest_msg)));
+    if (query.truncated) {
+        Log.warn("Too many diagnostic sources requested, max. count: %u", (unsigned)MAX_DIAG_SOURCES);
     }
-    return true;
-}
-
-bool readIds(pb_istream_t *stream, const pb_field_iter_t *field, void **arg)
-{
-    auto values = (std::vector<uint32_t>*)*arg;
-    uint64_t value = 0;
-    if (!pb_decode_varint(stream, &value)) {
-        return false;
-    }
-    // Log.printf("Value decoded: %d\r\n", value);
-    values->push_back(value);
-    return true;
-}
-
-int CloudProtocol::receiveDiagnosticsRequest(util::Buffer data, MessageChannel::OnResponse onResp) {
-    // TODO: Refactor this function to match the style of this file
-    // TODO: Use spark::Vector
-
-    std::vector<uint32_t> diagIds;
-    std::map<uint32_t, std::vector<uint8_t>> diagValueMap;
-
-    {
-        // Decode the incoming pb request which has the list of diag IDs to query
-
-        pb_istream_t stream = pb_istream_from_buffer((pb_byte_t*)data.data(), data.size());        
-        PB_CLOUD(DiagnosticsRequest) request = PB_CLOUD(DiagnosticsRequest_init_zero);
-
-        request.has_categories = false;
-        request.ids.arg = (void*)&diagIds;
-        request.ids.funcs.decode = &readIds;
-
-        bool decoded = pb_decode(&stream, PB_CLOUD(DiagnosticsRequest_fields), &request);
-
-        if (!decoded) {
-            Log.print(LOG_LEVEL_TRACE, "Decoding failed\r\n");
-            if (onResp) {
-                onResp(!decoded /* error */, 0 /* result */, util::Buffer());
+    Log.trace("Received Diagnostics request, source count: %u", (unsigned)query.count);
+    // Encode a response. The sources are queried as the response is being encoded, so it needs to be
+    // encoded in a single pass
+    PB_CLOUD(DiagnosticsResponse) respMsg = {};
+    respMsg.sources.arg = &query;
+    respMsg.sources.funcs.encode = [](auto strm, auto field, auto arg) {
+        auto query = (const DiagnosticsQuery*)*arg;
+        for (size_t i = 0; i < query->count; ++i) {
+            DiagnosticValue val = {};
+            int r = getDiagnosticValue(query->ids[i], val.data, sizeof(val.data));
+            if (r < 0) {
+                continue; // Skip sources that can't be queried
             }
-            return Error::ENCODING_FAILED;
-        }
-    }
-
-    {
-        // Get values for the diagnostics IDs
-        // Place them in a map
-
-        for (const auto& diagId : diagIds) {
-            Log.printf(LOG_LEVEL_TRACE, "Querying diag id: %lu\r\n", diagId);
-            std::vector<uint8_t> res;
-            if (!getDiagnosticValue(diagId, &res)) {
-                diagValueMap[diagId] = res;
+            val.size = r;
+            PB_CLOUD(DiagnosticsResponse_Source) srcMsg = {};
+            srcMsg.id = query->ids[i];
+            srcMsg.data.arg = &val;
+            srcMsg.data.funcs.encode = [](auto strm, auto field, auto arg) {
+                auto val = (const DiagnosticValue*)*arg;
+                if (!val->size) {
+                    return true;
+                }
+                return pb_encode_tag_for_field(strm, field) && pb_encode_string(strm, val->data, val->size);
+            };
+            if (!pb_encode_tag_for_field(strm, field) ||
+                    !pb_encode_submessage(strm, &PB_CLOUD(DiagnosticsResponse_Source_msg), &srcMsg)) {
+                return false;
             }
-
-            // for (const auto& pair: diagValueMap) {
-            //     Log.printf("ID: %d --- ", pair.first);
-            //     Log.print("Data: ");
-            //     for (int i=0; i<pair.second.size(); i++) {
-            //         Log.printf("%02X", pair.second[i]);
-            //     }
-            //     Log.printf("\r\n");
-            // }
-        }
-    }
-
-
-    {
-        // Encode the response and send it using onResp callback
-        auto buffer = util::Buffer(256);
-
-        PB_CLOUD(DiagnosticsResponse) response = PB_CLOUD(DiagnosticsResponse_init_zero);
-        pb_ostream_t ostream = pb_ostream_from_buffer((pb_byte_t*) buffer.data(), buffer.size());
-        
-        response.sources.arg = (void*)&diagValueMap;
-        response.sources.funcs.encode = &encodeDiagMap;
-
-        int encodePassed = pb_encode(&ostream, PB_CLOUD(DiagnosticsResponse_fields), &response);
-        if (!encodePassed) {
-            Log.printf(LOG_LEVEL_TRACE, "Encoding failed: %d \r\n", !encodePassed);
-            onResp(1 /* error */, 0 /* result */, util::Buffer());
-            return Error::ENCODING_FAILED;
-        }
-
-        buffer.resize(ostream.bytes_written);
-
-        Log.print(LOG_LEVEL_TRACE, "Encoded Bytes\r\n");
-        for (size_t i = 0; i < buffer.size(); ++i) {
-            Log.printf(LOG_LEVEL_TRACE, "%02X", buffer.data()[i]);
-        }
-
-        Log.print(LOG_LEVEL_TRACE, "\r\n");
-
-        if (onResp) {
-            onResp(0 /* error */, 0 /* result */, std::move(buffer));
         }
+        return true;
+    };
+    util::Buffer respData;
+    CHECK(respData.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    CHECK(respData.resize(MAX_DIAGNOSTICS_RESPONSE_SIZE));
+    auto strm = pb_ostream_from_buffer((pb_byte_t*)respData.data(), respData.size());
+    if (!pb_encode(&strm, &PB_CLOUD(DiagnosticsResponse_msg), &respMsg)) {
+        Log.error("Failed to encode Diagnostics response: %s", PB_GET_ERROR(&strm));
+        return Error::ENCODING_FAILED;
     }
-
+    respData.resize(strm.bytes_written);
+    // Send a response
+    onResp(0 /* error */, 0 /* result */, std::move(respData));
     return 0;
 }
 
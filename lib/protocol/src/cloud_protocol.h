@@ -6,6 +6,9 @@
 #include <spark_wiring_map.h>
 
 #include "message_channel.h"
+#include "event_schema.h"
+#include "util/bit_packing.h"
+#include "util/sha1.h"
 
 namespace particle::constrained {
 
@@ -13,24 +16,137 @@ class CloudProtocol;
 
 class CloudProtocolConfig {
 public:
-    CloudProtocolConfig() = default;
+    CloudProtocolConfig() :
+            batchWindow_(0),
+            systemVersion_(0) {
+    }
 
     CloudProtocolConfig& onSend(MessageChannel::OnSend fn) {
         onSend_ = std::move(fn);
         return *this;
     }
 
+    // Estimate the time on air of an uplink. Used to randomize the retransmissions of requests
+    CloudProtocolConfig& timeOnAir(MessageChannel::TimeOnAir fn) {
+        timeOnAir_ = std::move(fn);
+        return *this;
+    }
+
+    // Collect the events published within the given time window and send them in a single request.
+    // A batch is sent earlier if it fills the maximum payload size. 0 disables batching
+    CloudProtocolConfig& eventBatching(system_tick_t window) {
+        batchWindow_ = window;
+        return *this;
+    }
+
+    // Module version of the system firmware. Reported to the cloud in the Hello request and the system
+    // description
+    CloudProtocolConfig& systemVersion(uint32_t version) {
+        systemVersion_ = version;
+        return *this;
+    }
+
+    // Version of the product firmware, if the device is running one
+    CloudProtocolConfig& productVersion(uint32_t version) {
+        productVersion_ = version;
+        return *this;
+    }
+
 private:
     MessageChannel::OnSend onSend_;
+    MessageChannel::TimeOnAir timeOnAir_;
+    system_tick_t batchWindow_;
+    uint32_t systemVersion_;
+    std::optional<uint32_t> productVersion_;
 
     friend class CloudProtocol;
 };
 
+class PublishOptions {
+public:
+    PublishOptions() :
+            maxRetries_(0),
+            confirmed_(true),
+            noResp_(false),
+            compressed_(false) {
+    }
+
+    // Request an acknowledgement from the network for the uplink carrying the event
+    PublishOptions& confirmed(bool enabled) {
+        confirmed_ = enabled;
+        return *this;
+    }
+
+    bool confirmed() const {
+        return confirmed_;
+    }
+
+    // Do not wait for a response from the cloud
+    PublishOptions& noResponse(bool enabled) {
+        noResp_ = enabled;
+        return *this;
+    }
+
+    bool noResponse() const {
+        return noResp_;
+    }
+
+    // Number of times the event is sent again if the cloud doesn't respond
+    PublishOptions& maxRetries(unsigned count) {
+        maxRetries_ = count;
+        return *this;
+    }
+
+    unsigned maxRetries() const {
+        return maxRetries_;
+    }
+
+    // Compress the event data if that makes it smaller. The cloud must support compressed requests
+    PublishOptions& compressed(bool enabled) {
+        compressed_ = enabled;
+        return *this;
+    }
+
+    bool compressed() const {
+        return compressed_;
+    }
+
+    PublishOptions& onAck(MessageChannel::OnAck fn) {
+        onAck_ = std::move(fn);
+        return *this;
+    }
+
+    const MessageChannel::OnAck& onAck() const {
+        return onAck_;
+    }
+
+private:
+    MessageChannel::OnAck onAck_;
+    unsigned maxRetries_;
+    bool confirmed_;
+    bool noResp_;
+    bool compressed_;
+};
+
 class CloudProtocol {
 public:
     typedef std::function<void(int code, Variant data)> OnEvent;
+    // Receives the event data encoded with an EventSchema
+    typedef std::function<int(int code, const char* data, size_t size)> OnEncodedEvent;
 
     CloudProtocol() :
+            batchSize_(0),
+            batchTime_(0),
+            subscrsRev_(1),
+            sentSubscrsRev_(0),
+            syncedSubscrsRev_(0),
+            subscrsRetryTime_(0),
+            subscrsRetryDelay_(0),
+            subscrsReqPending_(false),
+            helloRetryTime_(0),
+            helloRetryDelay_(0),
+            helloPending_(false),
+            helloSent_(false),
             state_(State::NEW) {
     }
 
@@ -39,18 +155,55 @@ public:
     int connect();
     void disconnect();
     int receive(util::Buffer data, int port);
+    int changeMaxPayloadSize(size_t size);
     int run();
 
-    int publish(int code) {
-        return publishImpl(code, std::nullopt);
+    int publish(int code, PublishOptions opts = PublishOptions()) {
+        return publishImpl(code, nullptr /* data */, nullptr /* encodedData */, 0 /* encodedSize */, std::move(opts));
+    }
+
+    int publish(int code, const Variant& data, PublishOptions opts = PublishOptions()) {
+        return publishImpl(code, &data, nullptr /* encodedData */, 0 /* encodedSize */, std::move(opts));
     }
 
-    int publish(int code, Variant data) {
-        return publishImpl(code, std::move(data));
+    // Publish an event using the binary layout defined by an EventSchema
+    template<typename SchemaT>
+    int publish(const SchemaT& schema, const typename SchemaT::Type& data, PublishOptions opts = PublishOptions()) {
+        char buf[SchemaT::ENCODED_SIZE + 1]; // Avoid a zero-sized array
+        int n = schema.encode(data, buf, sizeof(buf));
+        if (n < 0) {
+            return n;
+        }
+        return publishImpl(schema.code(), nullptr /* data */, buf, n, std::move(opts));
     }
 
     int subscribe(int code, OnEvent onEvent);
 
+    // Encode the data of the events with the given code as a sequence of bit-packed fields instead of
+    // CBOR. The data of such events is a map containing a numeric value for each field. The array of
+    // fields is not copied and needs to remain valid
+    int setPackedEncoding(int code, const util::PackedField* fields, size_t fieldCount);
+
+    template<size_t N>
+    int setPackedEncoding(int code, const util::PackedField (&fields)[N]) {
+        return setPackedEncoding(code, fields, N);
+    }
+
+    // Subscribe to events encoded with an EventSchema. The handler is called as `fn(code, data)` where
+    // `data` is a reference to the decoded structure
+    template<typename SchemaT, typename F, typename = typename SchemaT::Type>
+    int subscribe(const SchemaT& schema, F fn) {
+        return subscribeEncoded(schema.code(), [schema, fn = std::move(fn)](int code, const char* data, size_t size) {
+            typename SchemaT::Type val = {};
+            int r = schema.decode(data, size, val);
+            if (r < 0) {
+                return r;
+            }
+            fn(code, val);
+            return 0;
+        });
+    }
+
 private:
     enum class State {
         NEW,
@@ -58,17 +211,96 @@ private:
         CONNECTED
     };
 
+    struct Subscription {
+        OnEvent onEvent;
+        OnEncodedEvent onEncodedEvent;
+    };
+
+    // Encoded description of the device. Its hash is sent to the cloud in the Hello request
+    struct Description {
+        util::Buffer data; // Encoded SystemDescribe or AppDescription message
+        char hash[util::Sha1::HASH_SIZE];
+        unsigned rev; // Revision of the subscriptions the description was built for. 0 if not built
+
+        Description() :
+                hash(),
+                rev(0) {
+        }
+    };
+
+    // Encoded DescriptionResponse message for the last requested set of flags
+    struct DescriptionResponse {
+        util::Buffer data;
+        uint32_t systemFlags;
+        uint32_t appFlags;
+        unsigned appRev; // Revision of the app description included in the response. 0 if not built
+
+        DescriptionResponse() :
+                systemFlags(0),
+                appFlags(0),
+                appRev(0) {
+        }
+    };
+
+    struct PackedEncoding {
+        const util::PackedField* fields;
+        size_t fieldCount;
+    };
+
+    struct BatchedEvent {
+        util::Buffer data; // Encoded EventRequest message
+        PublishOptions opts;
+        system_tick_t time; // Time the event was added to the batch
+    };
+
     MessageChannel channel_;
     CloudProtocolConfig conf_;
-    Map<int, OnEvent> subscrs_;
+    Map<int, Subscription> subscrs_;
+    Map<int, PackedEncoding> packedEncs_;
+    Description sysDesc_;
+    Description appDesc_;
+    DescriptionResponse descResp_;
+    Vector<BatchedEvent> batch_;
+    size_t batchSize_; // Encoded size of the batched events
+    system_tick_t batchTime_; // Time the first event was added to the batch
+    unsigned subscrsRev_; // Incremented every time the set of subscribed event codes changes
+    unsigned sentSubscrsRev_; // Revision of the subscriptions sent to the cloud in the current session
+    unsigned syncedSubscrsRev_; // Revision of the subscriptions acknowledged by the cloud
+    system_tick_t subscrsRetryTime_; // Time of the last failed attempt to send the subscriptions
+    system_tick_t subscrsRetryDelay_; // Delay before the next attempt, or 0 if the last attempt didn't fail
+    bool subscrsReqPending_;
+    system_tick_t helloRetryTime_; // Time of the last failed attempt to send the Hello
+    system_tick_t helloRetryDelay_; // Delay before the next attempt, or 0 if the last attempt didn't fail
+    bool helloPending_; // The Hello request of the current session hasn't completed yet
+    bool helloSent_; // The Hello request is in flight
     State state_;
 
-    int publishImpl(int code, std::optional<Variant> data);
+    int publishImpl(int code, const Variant* data, const char* encodedData, size_t encodedSize, PublishOptions opts);
+    int sendEventRequest(unsigned type, util::Buffer data, bool compressed, RequestOptions opts);
+
+    int subscribeEncoded(int code, OnEncodedEvent onEvent);
+    int addSubscription(int code, Subscription subscr);
+    int sendSubscriptions();
+    void delaySubscriptions();
+    int encodeSubscriptions(util::Buffer& data);
+    int getSubscribedCodes(Vector<unsigned>& codes) const;
+
+    int sendHello();
+    void delayHello();
+    int sendHelloRequest();
+    int updateSystemDescription();
+    int updateAppDescription();
+    int encodeDescriptionResponse(uint32_t systemFlags, uint32_t appFlags);
+
+    int addToBatch(util::Buffer msg, PublishOptions opts);
+    int flushBatch();
+    void cancelBatch(Vector<BatchedEvent>& batch, int error);
 
     int receiveRequest(unsigned type, util::Buffer data, MessageChannel::OnResponse onResp);
 
     int receiveEventRequest(util::Buffer data, MessageChannel::OnResponse onResp);
     int receiveDiagnosticsRequest(util::Buffer data, MessageChannel::OnResponse onResp);
+    int receiveDescriptionRequest(util::Buffer data, MessageChannel::OnResponse onResp);
 };
 
 } // namespace particle::constrained
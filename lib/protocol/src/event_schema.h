@@ -0,0 +1,150 @@
+#pragma once
+
+#include <tuple>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+
+#include <spark_wiring_error.h>
+
+namespace particle::constrained {
+
+namespace detail {
+
+inline void encodeLittleEndian(uint64_t val, char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = (val >> (i * 8)) & 0xff;
+    }
+}
+
+inline uint64_t decodeLittleEndian(const char* data, size_t size) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < size; ++i) {
+        val |= (uint64_t)(uint8_t)data[i] << (i * 8);
+    }
+    return val;
+}
+
+template<typename T>
+struct FieldCodec {
+    typedef std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::common_type<T>> BaseType;
+    typedef typename BaseType::type ValueType;
+    typedef std::conditional_t<std::is_floating_point_v<ValueType>,
+            std::conditional_t<sizeof(ValueType) == 4, uint32_t, uint64_t>, ValueType> WireType;
+
+    static_assert(std::is_arithmetic_v<ValueType>, "Unsupported field type");
+    static_assert(sizeof(WireType) == sizeof(ValueType), "Unsupported floating point type");
+
+    static const size_t SIZE = sizeof(WireType);
+
+    static void encode(T val, char* data) {
+        WireType v;
+        std::memcpy(&v, &val, sizeof(v));
+        encodeLittleEndian((uint64_t)v, data, SIZE);
+    }
+
+    static T decode(const char* data) {
+        const auto v = (WireType)decodeLittleEndian(data, SIZE);
+        T val;
+        std::memcpy(&val, &v, sizeof(val));
+        return val;
+    }
+};
+
+} // namespace detail
+
+// Field of an event structure. Fields are encoded in little-endian byte order using the size of their type
+template<typename T, typename M>
+class EventField {
+public:
+    typedef T ObjectType;
+    typedef M ValueType;
+
+    static const size_t SIZE = detail::FieldCodec<M>::SIZE;
+
+    constexpr explicit EventField(M T::* member) :
+            member_(member) {
+    }
+
+    void encode(const T& obj, char* data) const {
+        detail::FieldCodec<M>::encode(obj.*member_, data);
+    }
+
+    void decode(const char* data, T& obj) const {
+        obj.*member_ = detail::FieldCodec<M>::decode(data);
+    }
+
+private:
+    M T::* member_;
+};
+
+template<typename T, typename M>
+constexpr EventField<T, M> eventField(M T::* member) {
+    return EventField<T, M>(member);
+}
+
+// Binary layout of the data of the events with a given code. The fields are encoded in the order in
+// which they are declared, without names or tags, so the cloud needs to know the layout of the code.
+// Example:
+//
+//   struct Reading {
+//       float temperature;
+//       uint8_t humidity;
+//   };
+//
+//   const auto READING_EVENT = eventSchema<Reading>(10 /* code */, eventField(&Reading::temperature),
+//           eventField(&Reading::humidity));
+//
+//   cloud.publish(READING_EVENT, Reading{ 21.5, 40 });
+template<typename T, typename... FieldsT>
+class EventSchema {
+public:
+    typedef T Type;
+
+    static const size_t ENCODED_SIZE = (FieldsT::SIZE + ... + 0);
+
+    static_assert((std::is_same_v<typename FieldsT::ObjectType, T> && ...), "Field belongs to a different type");
+
+    constexpr explicit EventSchema(int code, FieldsT... fields) :
+            fields_(fields...),
+            code_(code) {
+    }
+
+    constexpr int code() const {
+        return code_;
+    }
+
+    // Returns the size of the encoded data
+    int encode(const T& val, char* data, size_t size) const {
+        if (size < ENCODED_SIZE) {
+            return Error::TOO_LARGE;
+        }
+        std::apply([&](const auto&... field) {
+            size_t offs = 0;
+            ((field.encode(val, data + offs), offs += std::decay_t<decltype(field)>::SIZE), ...);
+        }, fields_);
+        return ENCODED_SIZE;
+    }
+
+    int decode(const char* data, size_t size, T& val) const {
+        if (size != ENCODED_SIZE) {
+            return Error::BAD_DATA;
+        }
+        std::apply([&](const auto&... field) {
+            size_t offs = 0;
+            ((field.decode(data + offs, val), offs += std::decay_t<decltype(field)>::SIZE), ...);
+        }, fields_);
+        return 0;
+    }
+
+private:
+    std::tuple<FieldsT...> fields_;
+    int code_;
+};
+
+template<typename T, typename... FieldsT>
+constexpr EventSchema<T, FieldsT...> eventSchema(int code, FieldsT... fields) {
+    return EventSchema<T, FieldsT...>(code, fields...);
+}
+
+} // namespace particle::constrained
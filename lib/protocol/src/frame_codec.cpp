@@ -37,7 +37,7 @@ int encodeFrameHeader(char* data, size_t size, const FrameHeader& h) {
             if (h.blockNumber() > MAX_BLOCK_NUMBER || !h.hasMore()) {
                 return Error::INVALID_ARGUMENT;
             }
-            v |= h.blockNumber();
+            v |= BLOCK_NUMBER_FLAG | h.blockNumber();
             if (h.more()) {
                 v |= MORE_FLAG;
             }
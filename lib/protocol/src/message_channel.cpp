@@ -1,8 +1,11 @@
 #include <utility>
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
 
 #include <spark_wiring_logging.h>
 #include <spark_wiring_error.h>
+#include <spark_wiring_vector.h>
 
 #include <scope_guard.h>
 #include <check.h>
@@ -17,32 +20,159 @@ namespace {
 const unsigned MIN_LORAWAN_APP_PORT = 1;
 const unsigned MAX_LORAWAN_APP_PORT = 223;
 
+// Request type or result code field of a REQUEST_RESPONSE_BLOCK frame. The first block of a request
+// or response is sent in a REQUEST, REQUEST_NO_RESPONSE or RESPONSE frame with block number 0
+enum BlockFrameCode {
+    REQUEST_BLOCK = 0, // Subsequent block of a request
+    RESPONSE_BLOCK = 1, // Subsequent block of a response
+    RESEND_REQUEST_BLOCKS = 2, // Sent by the recipient of a request to get the missing blocks again
+    RESEND_RESPONSE_BLOCKS = 3 // Sent by the recipient of a response
+};
+
+// The payload of a resend request is a big-endian bitmap where bit N is set if block N is missing
+const size_t BLOCK_BITMAP_SIZE = 8;
+
+// Time after which a sent frame is considered complete if its acknowledgement is never reported
+const system_tick_t SEND_TIMEOUT = 60000;
+// Time after which a transfer is discarded if there's no progress. A sent transfer is also kept
+// for that long so that the recipient can request missing blocks
+const system_tick_t TRANSFER_TIMEOUT = 60000;
+// Time without new blocks after which the missing blocks are requested from the sender
+const system_tick_t RESEND_REQUEST_DELAY = 10000;
+const unsigned MAX_RESEND_REQUESTS = 3;
+// Delay before trying again to send a block that the transport couldn't send
+const system_tick_t BLOCK_SEND_RETRY_DELAY = 1000;
+const unsigned MAX_BLOCK_SEND_ATTEMPTS = 3;
+
+// The random delay added to the timeout of a retransmitted request is up to this many times the time
+// on air of the request, so that devices that missed the same downlink don't retry in lockstep
+const unsigned RETRY_JITTER_AIRTIMES = 10;
+// Minimum range of the random delay, used when the time on air is unknown or short
+const system_tick_t MIN_RETRY_JITTER = 1000;
+// Maximum timeout of a retransmitted request, regardless of the backoff factor
+const system_tick_t MAX_RETRY_TIMEOUT = 3600000;
+// Time for which a received request is remembered in order to detect its retransmissions
+const system_tick_t RECENT_REQUEST_TTL = 10 * 60 * 1000;
+
+inline unsigned transferKey(unsigned reqId, bool response) {
+    return (reqId << 1) | (response ? 1 : 0);
+}
+
+inline uint64_t blockBit(unsigned num) {
+    return (uint64_t)1 << num;
+}
+
+// Bits of the blocks [0, count)
+inline uint64_t blockMask(unsigned count) {
+    return (count >= 64) ? ~(uint64_t)0 : blockBit(count) - 1;
+}
+
+unsigned lowestBlock(uint64_t blocks) {
+    unsigned n = 0;
+    while (!(blocks & 1)) {
+        blocks >>= 1;
+        ++n;
+    }
+    return n;
+}
+
+// Compares deadlines that are less than 2^31 ms apart, taking the wraparound of millis() into account
+inline bool deadlinePassed(system_tick_t deadline, system_tick_t now) {
+    return (int32_t)(now - deadline) >= 0;
+}
+
+unsigned highestBlock(uint64_t blocks) {
+    unsigned n = 0;
+    while (blocks >>= 1) {
+        ++n;
+    }
+    return n;
+}
+
 } // namespace
 
-struct MessageChannel::InRequest: RefCount {
+static_assert(((MAX_REQUEST_ID + 1) % MessageChannel::MAX_PENDING_REQUESTS) == 0 &&
+        ((MAX_REQUEST_ID + 1) % MessageChannel::MAX_RECENT_REQUESTS) == 0,
+        "Request IDs must map to the same slot after they wrap around");
+
+// Request or response being received in blocks
+struct MessageChannel::InTransfer: RefCount {
+    struct Block {
+        util::Buffer data;
+        unsigned num;
+    };
+
+    Vector<Block> blocks; // Received blocks in the order of arrival
+    uint64_t received; // Blocks received so far
+    system_tick_t lastTime; // Time of the last received block or resend request
+    size_t size; // Total size of the received blocks
     unsigned id;
-    unsigned sessionId;
-
-    InRequest() :
+    unsigned code; // Request type or result code, valid once block 0 is received
+    unsigned resendRequests;
+    int lastBlock; // Number of the block with the "more" flag cleared, or -1 if not received yet
+    FrameType firstFrameType;
+    bool response;
+    bool resendNow; // The last block was received but some blocks are missing
+
+    InTransfer() :
+            received(0),
+            lastTime(0),
+            size(0),
             id(0),
-            sessionId(0) {
+            code(0),
+            resendRequests(0),
+            lastBlock(-1),
+            firstFrameType(FrameType::REQUEST),
+            response(false),
+            resendNow(false) {
     }
 };
 
-struct MessageChannel::OutRequest: RefCount {
-    RequestOptions options;
-    OnResponse onResponse;
+// Request or response being sent in blocks
+struct MessageChannel::OutTransfer: RefCount {
+    util::Buffer data;
+    OnAck onAck;
+    uint64_t pending; // Blocks to send
+    uint64_t unacked; // Blocks sent but not acknowledged yet
+    system_tick_t lastTime; // Time of the last sent or acknowledged block or resend request
+    system_tick_t retryTime; // Time of the last attempt to send a block that the transport couldn't send
+    size_t blockSize;
+    unsigned blockCount;
     unsigned id;
-
-    OutRequest() :
-            id(0) {
+    unsigned code; // Request type or result code
+    unsigned attempts; // Number of failed attempts to send a block since the last delivered one
+    FrameType frameType; // Frame type of the first block
+    bool confirmed;
+    bool response;
+    bool delayed; // Waiting before retrying to send a block
+    bool acked; // `onAck` has been called
+
+    OutTransfer() :
+            pending(0),
+            unacked(0),
+            lastTime(0),
+            retryTime(0),
+            blockSize(0),
+            blockCount(0),
+            id(0),
+            code(0),
+            attempts(0),
+            frameType(FrameType::REQUEST),
+            confirmed(true),
+            response(false),
+            delayed(false),
+            acked(false) {
     }
 };
 
 MessageChannel::MessageChannel() :
-        maxPayloadSize_(100), // TODO
+        outReqs_(),
+        recentReqs_(),
+        maxPayloadSize_(DEFAULT_MAX_PAYLOAD_SIZE),
+        sendTime_(0),
         nextOutReqId_(0),
         sessId_(0),
+        sending_(false),
         inited_(false) {
 }
 
@@ -69,58 +199,16 @@ int MessageChannel::receive(util::Buffer data, int port) {
     FrameHeader h;
     size_t headerSize = CHECK(decodeFrameHeader(data.data(), data.size(), h));
 
-    // Resize the buffer so that it only contains the payload data
-    std::memmove(data.data(), data.data() + headerSize, data.size() - headerSize);
-    CHECK(data.resize(data.size() - headerSize));
+    // Leave only the payload data in the buffer
+    data.trimFront(headerSize);
 
-    if (!h.hasFrameType() || h.frameType() == FrameType::REQUEST || h.frameType() == FrameType::REQUEST_NO_RESPONSE) {
-        // Handle a request
-        if (!conf_.onReq_) {
-            return 0; // Ignore
-        }
-        OnResponse onResp;
+    if (h.hasBlockNumber()) {
+        CHECK(receiveBlock(h, std::move(data)));
+    } else if (!h.hasFrameType() || h.frameType() == FrameType::REQUEST || h.frameType() == FrameType::REQUEST_NO_RESPONSE) {
         bool noResp = !h.hasFrameType() || h.frameType() == FrameType::REQUEST_NO_RESPONSE;
-        if (!noResp) {
-            RefCountPtr<InRequest> req = makeRefCountPtr<InRequest>();
-            if (!req) {
-                return Error::NO_MEMORY;
-            }
-            req->id = h.requestId();
-            req->sessionId = sessId_;
-            onResp = [this, req = std::move(req)](int error, int result, util::Buffer data) {
-                if (error < 0) {
-                    Log.error("Request error: %d", error);
-                    return 0;
-                }
-                return sendResponse(result, std::move(data), std::move(req));
-            };
-        } else {
-            // No response needed
-            onResp = [this, sessId = sessId_](int error, int result, util::Buffer data) -> int {
-                if (sessId != sessId_) {
-                    return Error::CANCELLED;
-                }
-                return 0;
-            };
-        }
-        int r = conf_.onReq_(h.requestTypeOrResultCode(), std::move(data), std::move(onResp));
-        if (r < 0) {
-            Log.error("Request handler failed: %d", r);
-        }
-    } else if (h.hasFrameType() && h.frameType() == FrameType::RESPONSE) {
-        // Handle a response
-        auto it = outReqs_.find(h.requestId());
-        if (it == outReqs_.end()) {
-            return 0;
-        }
-        auto req = std::move(it->second);
-        outReqs_.erase(it);
-        if (req->onResponse) {
-            int r = req->onResponse(0 /* error */, h.requestTypeOrResultCode(), std::move(data));
-            if (r < 0) {
-                Log.error("Response handler failed: %d", r);
-            }
-        }
+        CHECK(receiveRequest(h.requestTypeOrResultCode(), h.requestId(), noResp, std::move(data)));
+    } else if (h.frameType() == FrameType::RESPONSE) {
+        CHECK(receiveResponse(h.requestId(), h.requestTypeOrResultCode(), std::move(data)));
     }
     return 0;
 }
@@ -129,14 +217,19 @@ int MessageChannel::changeMaxPayloadSize(size_t size) {
     if (!inited_) {
         return Error::INVALID_STATE;
     }
-    return Error::NOT_SUPPORTED; // TODO
+    if (size <= MAX_FRAME_HEADER_SIZE) {
+        return Error::INVALID_ARGUMENT;
+    }
+    maxPayloadSize_ = size;
+    return 0;
 }
 
 int MessageChannel::run() {
     if (!inited_) {
         return 0;
     }
-    // TODO
+    expireRequests();
+    processTransfers();
     return 0;
 }
 
@@ -145,29 +238,46 @@ int MessageChannel::sendRequest(unsigned type, util::Buffer data, OnResponse onR
         return Error::INVALID_STATE;
     }
 
-    auto id = nextOutReqId_;
-    if (++nextOutReqId_ > MAX_REQUEST_ID) {
-        nextOutReqId_ = 0;
-    }
-
     bool noResp = opts.noResponse();
-    if (!noResp) {
-        RefCountPtr<OutRequest> req = makeRefCountPtr<OutRequest>();
+    bool confirmed = opts.confirmed();
+    auto ackHandler = opts.onAck();
+    unsigned id = 0;
+    OutRequest* req = nullptr;
+    if (noResp) {
+        id = nextRequestId();
+    } else {
+        // Skip the IDs whose slots are taken by pending requests
+        for (size_t i = 0; i < MAX_PENDING_REQUESTS && !req; ++i) {
+            id = nextRequestId();
+            auto& slot = outReqs_[id % MAX_PENDING_REQUESTS];
+            if (!slot.used) {
+                req = &slot;
+            }
+        }
         if (!req) {
-            return Error::NO_MEMORY;
+            return Error::LIMIT_EXCEEDED;
+        }
+    }
+    NAMED_SCOPE_GUARD(removeReqGuard, {
+        if (req) {
+            takeOutRequest(*req);
         }
+    });
+    if (req) {
+        req->used = true;
         req->id = id;
+        req->type = type;
+        req->retries = 0;
+        req->timeout = opts.timeout();
         req->onResponse = std::move(onResp);
         req->options = std::move(opts);
-        if (!outReqs_.set(id, std::move(req))) {
-            return Error::NO_MEMORY;
+        if (req->options.maxRetries() > 0 && req->timeout > 0) {
+            req->data = util::Buffer(data.data(), data.size());
+            if (req->data.size() != data.size()) {
+                return Error::NO_MEMORY;
+            }
         }
     }
-    NAMED_SCOPE_GUARD(removeReqGuard, {
-        if (!noResp) {
-            outReqs_.remove(id);
-        }
-    });
 
     FrameHeader h;
     h.requestTypeOrResultCode(type);
@@ -177,14 +287,16 @@ int MessageChannel::sendRequest(unsigned type, util::Buffer data, OnResponse onR
     }
     char headerData[MAX_FRAME_HEADER_SIZE] = {};
     size_t headerSize = CHECK(encodeFrameHeader(headerData, sizeof(headerData), h));
-
-    util::Buffer buf;
-    CHECK(buf.resize(headerSize + data.size()));
-    std::memcpy(buf.data(), headerData, headerSize);
-    std::memcpy(buf.data() + headerSize, data.data(), data.size());
-
-    assert(conf_.onSend_);
-    CHECK(conf_.onSend_(std::move(buf), conf_.port_, nullptr /* TODO: onAck */));
+    if (headerSize + data.size() > maxPayloadSize_) {
+        // Send the request in blocks. The request times out only once all of them are delivered, see blockAcked()
+        auto frameType = noResp ? FrameType::REQUEST_NO_RESPONSE : FrameType::REQUEST;
+        CHECK(startTransfer(id, type, frameType, std::move(data), confirmed, std::move(ackHandler)));
+    } else {
+        if (req) {
+            startTimer(*req, req->timeout);
+        }
+        CHECK(sendFrame(h, std::move(data), confirmed, std::move(ackHandler)));
+    }
 
     removeReqGuard.dismiss();
 
@@ -196,43 +308,656 @@ void MessageChannel::reset() {
         return;
     }
 
-    decltype(outReqs_) outReqs;
+    // The callbacks may send new requests, which must not be cancelled, so remember the slots in use
+    static_assert(MAX_PENDING_REQUESTS <= 32, "Too many request slots");
+    uint32_t usedSlots = 0;
+    for (size_t i = 0; i < MAX_PENDING_REQUESTS; ++i) {
+        if (outReqs_[i].used) {
+            usedSlots |= (uint32_t)1 << i;
+        }
+    }
+    for (auto& r: recentReqs_) {
+        r = RecentRequest();
+    }
+    decltype(outTransfers_) outTransfers;
+    decltype(inTransfers_) inTransfers;
     using std::swap;
-    swap(outReqs, outReqs_);
+    swap(outTransfers, outTransfers_);
+    swap(inTransfers, inTransfers_);
 
     ++sessId_;
+    sending_ = false;
 
     // Cancel outgoing requests
-    for (auto& [id, req]: outReqs) {
-        if (req->onResponse && !req->options.noResponse()) {
-            req->onResponse(Error::CANCELLED, 0, util::Buffer());
+    for (auto& [key, t]: outTransfers) {
+        if (t->onAck && !t->acked) {
+            t->onAck(Error::CANCELLED);
+        }
+    }
+    for (size_t i = 0; i < MAX_PENDING_REQUESTS; ++i) {
+        if (!(usedSlots & ((uint32_t)1 << i))) {
+            continue;
+        }
+        auto req = takeOutRequest(outReqs_[i]);
+        if (req.onResponse) {
+            req.onResponse(Error::CANCELLED, 0, util::Buffer());
         }
     }
 }
 
-int MessageChannel::sendResponse(int result, util::Buffer data, RefCountPtr<InRequest> req) {
-    assert(req);
-    if (req->sessionId != sessId_) {
+int MessageChannel::sendResponse(int result, util::Buffer data, const InRequest& req) {
+    if (req.sessionId != sessId_) {
         return Error::CANCELLED;
     }
 
+    // Keep a copy of the response in case the request is retransmitted. Shared data is not copied
+    auto recent = findRecentRequest(req.id, req.sessionId);
+    if (recent) {
+        recent->response = data;
+        recent->result = result;
+        recent->responded = (recent->response.size() == data.size());
+    }
+
+    return sendResponse(req.id, result, std::move(data));
+}
+
+int MessageChannel::sendResponse(unsigned id, int result, util::Buffer data) {
+    OnAck onAck = [id](int error) {
+        if (error < 0) {
+            Log.warn("Response was not acknowledged, request ID: %u", id);
+        }
+    };
+
     FrameHeader h;
     h.requestTypeOrResultCode(result);
     h.frameType(FrameType::RESPONSE);
-    h.requestId(req->id);
+    h.requestId(id);
 
     char headerData[MAX_FRAME_HEADER_SIZE] = {};
     size_t headerSize = CHECK(encodeFrameHeader(headerData, sizeof(headerData), h));
+    if (headerSize + data.size() > maxPayloadSize_) {
+        // Send the response in blocks
+        CHECK(startTransfer(id, result, FrameType::RESPONSE, std::move(data), true /* confirmed */, std::move(onAck)));
+    } else {
+        CHECK(sendFrame(h, std::move(data), true /* confirmed */, std::move(onAck)));
+    }
 
+    return 0;
+}
+
+int MessageChannel::sendFrame(const FrameHeader& h, const char* data, size_t size, bool confirmed, OnAck onAck) {
     util::Buffer buf;
-    CHECK(buf.resize(headerSize + data.size()));
-    std::memcpy(buf.data(), headerData, headerSize);
-    std::memcpy(buf.data() + headerSize, data.data(), data.size());
+    CHECK(buf.reserveHeadroom(MAX_FRAME_HEADER_SIZE));
+    CHECK(buf.resize(size));
+    if (size) {
+        std::memcpy(buf.data(), data, size);
+    }
+    return sendFrame(h, std::move(buf), confirmed, std::move(onAck));
+}
+
+int MessageChannel::sendFrame(const FrameHeader& h, util::Buffer data, bool confirmed, OnAck onAck) {
+    char headerData[MAX_FRAME_HEADER_SIZE] = {};
+    size_t headerSize = CHECK(encodeFrameHeader(headerData, sizeof(headerData), h));
+    if (headerSize + data.size() > maxPayloadSize_) {
+        return Error::TOO_LARGE;
+    }
+    // The header is written in front of the data without copying it if the buffer has enough headroom
+    CHECK(data.prepend(headerData, headerSize));
 
     assert(conf_.onSend_);
-    CHECK(conf_.onSend_(std::move(buf), conf_.port_, nullptr /* TODO: onAck */));
+    CHECK(conf_.onSend_(std::move(data), conf_.port_, confirmed, [this, sessId = sessId_, onAck = std::move(onAck)](int error) {
+        if (sessId != sessId_) {
+            return;
+        }
+        sending_ = false;
+        if (onAck) {
+            onAck(error);
+        }
+    }));
+
+    // Blocks are only sent once the transport has completed the previous frame
+    sending_ = true;
+    sendTime_ = millis();
 
     return 0;
 }
 
+int MessageChannel::receiveRequest(unsigned type, unsigned id, bool noResp, util::Buffer data) {
+    if (!conf_.onReq_) {
+        return 0; // Ignore
+    }
+    OnResponse onResp;
+    if (!noResp) {
+        auto recent = findRecentRequest(id, sessId_);
+        if (recent) {
+            if (!recent->responded || outTransfers_.has(transferKey(id, true /* response */))) {
+                return 0; // The request is still being handled or the response is still being sent
+            }
+            Log.trace("Received retransmitted request, sending response again, request ID: %u", id);
+            return sendResponse(id, recent->result, recent->response);
+        }
+        // Replaces an older request that maps to the same slot
+        recentReqs_[id % MAX_RECENT_REQUESTS] = RecentRequest{ util::Buffer(), millis(), id, sessId_, 0 /* result */,
+                false /* responded */, true /* used */ };
+        onResp = [this, req = InRequest{ id, sessId_ }](int error, int result, util::Buffer data) {
+            if (error < 0) {
+                Log.error("Request error: %d", error);
+                // Let the handler process the request again if it is retransmitted
+                auto recent = findRecentRequest(req.id, req.sessionId);
+                if (recent) {
+                    *recent = RecentRequest();
+                }
+                return 0;
+            }
+            return sendResponse(result, std::move(data), req);
+        };
+    } else {
+        // No response needed
+        onResp = [this, sessId = sessId_](int error, int result, util::Buffer data) -> int {
+            if (sessId != sessId_) {
+                return Error::CANCELLED;
+            }
+            return 0;
+        };
+    }
+    int r = conf_.onReq_(type, std::move(data), std::move(onResp));
+    if (r < 0) {
+        Log.error("Request handler failed: %d", r);
+        auto recent = noResp ? nullptr : findRecentRequest(id, sessId_);
+        if (recent) {
+            *recent = RecentRequest();
+        }
+    }
+    return 0;
+}
+
+int MessageChannel::receiveResponse(unsigned id, int result, util::Buffer data) {
+    // The request has been received in full, no need to keep its blocks
+    auto t = outTransfers_.find(transferKey(id, false /* response */));
+    if (t != outTransfers_.end()) {
+        auto onAck = t->second->acked ? nullptr : std::move(t->second->onAck);
+        outTransfers_.erase(t);
+        if (onAck) {
+            onAck(0);
+        }
+    }
+    auto slot = findOutRequest(id);
+    if (!slot) {
+        return 0;
+    }
+    auto req = takeOutRequest(*slot);
+    if (req.onResponse) {
+        int r = req.onResponse(0 /* error */, result, std::move(data));
+        if (r < 0) {
+            Log.error("Response handler failed: %d", r);
+        }
+    }
+    return 0;
+}
+
+int MessageChannel::receiveBlock(const FrameHeader& h, util::Buffer data) {
+    const auto num = h.blockNumber();
+    bool response = false;
+    if (h.frameType() == FrameType::REQUEST_RESPONSE_BLOCK) {
+        switch (h.requestTypeOrResultCode()) {
+        case BlockFrameCode::REQUEST_BLOCK:
+            break;
+        case BlockFrameCode::RESPONSE_BLOCK:
+            response = true;
+            break;
+        case BlockFrameCode::RESEND_REQUEST_BLOCKS:
+            return receiveResendRequest(h.requestId(), false /* response */, data);
+        case BlockFrameCode::RESEND_RESPONSE_BLOCKS:
+            return receiveResendRequest(h.requestId(), true /* response */, data);
+        default:
+            return Error::BAD_DATA;
+        }
+        if (num == 0) {
+            return Error::BAD_DATA; // Block 0 is sent in the frame that starts the request or response
+        }
+    } else {
+        if (num != 0) {
+            return Error::BAD_DATA;
+        }
+        response = (h.frameType() == FrameType::RESPONSE);
+    }
+
+    const auto key = transferKey(h.requestId(), response);
+    RefCountPtr<InTransfer> t;
+    auto it = inTransfers_.find(key);
+    if (it != inTransfers_.end()) {
+        t = it->second;
+    } else {
+        if (response && !findOutRequest(h.requestId())) {
+            return 0; // Unknown or expired request
+        }
+        if ((size_t)inTransfers_.size() >= MAX_INCOMING_BLOCKWISE_TRANSFERS) {
+            Log.warn("Too many incoming transfers, request ID: %u", h.requestId());
+            return Error::LIMIT_EXCEEDED;
+        }
+        t = makeRefCountPtr<InTransfer>();
+        if (!t) {
+            return Error::NO_MEMORY;
+        }
+        t->id = h.requestId();
+        t->response = response;
+        if (!inTransfers_.set(key, t)) {
+            return Error::NO_MEMORY;
+        }
+    }
+    t->lastTime = millis();
+
+    if (t->received & blockBit(num)) {
+        return 0; // Duplicate
+    }
+    if (!h.more()) {
+        if (t->lastBlock >= 0 && t->lastBlock != (int)num) {
+            inTransfers_.remove(key);
+            return Error::BAD_DATA;
+        }
+        t->lastBlock = num;
+    } else if (t->lastBlock >= 0 && (int)num >= t->lastBlock) {
+        inTransfers_.remove(key);
+        return Error::BAD_DATA;
+    }
+    if (t->size + data.size() > MAX_BLOCKWISE_MESSAGE_SIZE) {
+        Log.error("Incoming transfer is too large, request ID: %u", t->id);
+        inTransfers_.remove(key);
+        return Error::TOO_LARGE;
+    }
+    if (num == 0) {
+        t->code = h.requestTypeOrResultCode();
+        t->firstFrameType = h.frameType();
+    }
+    const size_t size = data.size();
+    if (!t->blocks.append(InTransfer::Block{ std::move(data), num })) {
+        return Error::NO_MEMORY;
+    }
+    t->size += size;
+    t->received |= blockBit(num);
+
+    if (t->lastBlock < 0 || t->received != blockMask(t->lastBlock + 1)) {
+        if (t->lastBlock >= 0) {
+            t->resendNow = true;
+        }
+        return 0; // Wait for the remaining blocks
+    }
+
+    // Reassemble the payload
+    inTransfers_.remove(key);
+    util::Buffer buf;
+    CHECK(buf.resize(t->size));
+    size_t offs = 0;
+    for (int i = 0; i <= t->lastBlock; ++i) {
+        for (const auto& b: t->blocks) {
+            if (b.num == (unsigned)i) {
+                std::memcpy(buf.data() + offs, b.data.data(), b.data.size());
+                offs += b.data.size();
+                break;
+            }
+        }
+    }
+    Log.trace("Received %u bytes in %d blocks, request ID: %u", (unsigned)buf.size(), t->lastBlock + 1, t->id);
+    if (t->response) {
+        CHECK(receiveResponse(t->id, t->code, std::move(buf)));
+    } else {
+        bool noResp = (t->firstFrameType == FrameType::REQUEST_NO_RESPONSE);
+        CHECK(receiveRequest(t->code, t->id, noResp, std::move(buf)));
+    }
+    return 0;
+}
+
+int MessageChannel::receiveResendRequest(unsigned id, bool response, const util::Buffer& data) {
+    if (data.size() < BLOCK_BITMAP_SIZE) {
+        return Error::BAD_DATA;
+    }
+    uint64_t missing = 0;
+    for (size_t i = 0; i < BLOCK_BITMAP_SIZE; ++i) {
+        missing = (missing << 8) | (uint8_t)data.data()[i];
+    }
+    auto it = outTransfers_.find(transferKey(id, response));
+    if (it == outTransfers_.end()) {
+        Log.warn("Blocks requested for unknown transfer, request ID: %u", id);
+        return 0;
+    }
+    auto& t = it->second;
+    // Blocks that haven't been acknowledged yet may still arrive
+    t->pending |= missing & blockMask(t->blockCount) & ~t->unacked;
+    t->lastTime = millis();
+    return 0;
+}
+
+int MessageChannel::startTransfer(unsigned id, unsigned code, FrameType type, util::Buffer data, bool confirmed, OnAck onAck) {
+    const size_t blockSize = maxPayloadSize_ - MAX_FRAME_HEADER_SIZE;
+    const size_t blockCount = (data.size() + blockSize - 1) / blockSize;
+    if (blockCount > MAX_BLOCK_NUMBER + 1) {
+        return Error::TOO_LARGE;
+    }
+    auto t = makeRefCountPtr<OutTransfer>();
+    if (!t) {
+        return Error::NO_MEMORY;
+    }
+    t->data = std::move(data);
+    t->onAck = std::move(onAck);
+    t->pending = blockMask(blockCount);
+    t->lastTime = millis();
+    t->blockSize = blockSize;
+    t->blockCount = blockCount;
+    t->id = id;
+    t->code = code;
+    t->frameType = type;
+    t->confirmed = confirmed;
+    t->response = (type == FrameType::RESPONSE);
+    if (!outTransfers_.set(transferKey(id, t->response), t)) {
+        return Error::NO_MEMORY;
+    }
+    // The blocks are sent from run() one at a time
+    Log.trace("Sending %u bytes in %u blocks, request ID: %u", (unsigned)t->data.size(), (unsigned)blockCount, id);
+    return 0;
+}
+
+int MessageChannel::sendBlock(RefCountPtr<OutTransfer> t, unsigned num) {
+    FrameHeader h;
+    if (num == 0) {
+        h.frameType(t->frameType);
+        h.requestTypeOrResultCode(t->code);
+    } else {
+        h.frameType(FrameType::REQUEST_RESPONSE_BLOCK);
+        h.requestTypeOrResultCode(t->response ? BlockFrameCode::RESPONSE_BLOCK : BlockFrameCode::REQUEST_BLOCK);
+    }
+    h.requestId(t->id);
+    h.blockNumber(num);
+    h.more(num + 1 < t->blockCount);
+    const size_t offs = num * t->blockSize;
+    const size_t size = std::min(t->blockSize, t->data.size() - offs);
+    CHECK(sendFrame(h, t->data.data() + offs, size, t->confirmed, [this, key = transferKey(t->id, t->response), num](int error) {
+        blockAcked(key, num, error);
+    }));
+    t->pending &= ~blockBit(num);
+    t->unacked |= blockBit(num);
+    t->lastTime = millis();
+    return 0;
+}
+
+int MessageChannel::sendResendRequest(RefCountPtr<InTransfer> t) {
+    // If the last block hasn't been received, ask for the one that follows the received blocks too
+    unsigned count = (t->lastBlock >= 0) ? t->lastBlock + 1 : highestBlock(t->received) + 2;
+    uint64_t missing = blockMask(count) & ~t->received;
+    if (!missing) {
+        return 0;
+    }
+    char bitmap[BLOCK_BITMAP_SIZE] = {};
+    for (size_t i = 0; i < BLOCK_BITMAP_SIZE; ++i) {
+        bitmap[i] = (missing >> ((BLOCK_BITMAP_SIZE - i - 1) * 8)) & 0xff;
+    }
+    FrameHeader h;
+    h.frameType(FrameType::REQUEST_RESPONSE_BLOCK);
+    h.requestTypeOrResultCode(t->response ? BlockFrameCode::RESEND_RESPONSE_BLOCKS : BlockFrameCode::RESEND_REQUEST_BLOCKS);
+    h.requestId(t->id);
+    h.blockNumber(0);
+    h.more(false);
+    Log.trace("Requesting missing blocks, request ID: %u", t->id);
+    CHECK(sendFrame(h, bitmap, sizeof(bitmap), true /* confirmed */, nullptr));
+    return 0;
+}
+
+void MessageChannel::blockAcked(unsigned key, unsigned num, int error) {
+    auto it = outTransfers_.find(key);
+    if (it == outTransfers_.end()) {
+        return;
+    }
+    auto t = it->second;
+    if (!(t->unacked & blockBit(num))) {
+        return;
+    }
+    t->unacked &= ~blockBit(num);
+    t->lastTime = millis();
+    if (error < 0) {
+        if (++t->attempts >= MAX_BLOCK_SEND_ATTEMPTS) {
+            failTransfer(t, error);
+            return;
+        }
+        t->pending |= blockBit(num); // Send the block again
+        return;
+    }
+    t->attempts = 0;
+    if (!t->pending && !t->unacked) {
+        if (!t->response) {
+            // Give the recipient the full timeout to respond once the last block is delivered. This is also
+            // the case when the blocks of the request were sent again
+            auto req = findOutRequest(t->id);
+            if (req) {
+                startTimer(*req, req->timeout);
+            }
+        }
+        if (!t->acked) {
+            t->acked = true;
+            if (t->onAck) {
+                t->onAck(0);
+            }
+        }
+    }
+}
+
+void MessageChannel::startTimer(OutRequest& req, system_tick_t timeout) {
+    if (!timeout) {
+        return;
+    }
+    // Replaces the timer that was started earlier for the same request
+    req.deadline = millis() + timeout;
+    req.timerActive = true;
+}
+
+void MessageChannel::expireRequests() {
+    const auto now = millis();
+    // There are only a few slots, so scanning all of them is cheaper than maintaining a queue of timers
+    for (auto& slot: outReqs_) {
+        if (!slot.used || !slot.timerActive || !deadlinePassed(slot.deadline, now)) {
+            continue;
+        }
+        slot.timerActive = false;
+        if (slot.retries < slot.options.maxRetries()) {
+            int r = retryRequest(slot);
+            if (r >= 0) {
+                continue;
+            }
+            Log.error("Failed to send request again: %d", r);
+        }
+        auto req = takeOutRequest(slot);
+        Log.warn("Request timeout, request ID: %u", req.id);
+        auto t = outTransfers_.find(transferKey(req.id, false /* response */));
+        if (t != outTransfers_.end()) {
+            auto onAck = t->second->acked ? nullptr : std::move(t->second->onAck);
+            outTransfers_.erase(t);
+            if (onAck) {
+                onAck(Error::TIMEOUT);
+            }
+        }
+        if (req.onResponse) {
+            req.onResponse(Error::TIMEOUT, 0, util::Buffer());
+        }
+    }
+}
+
+int MessageChannel::retryRequest(OutRequest& req) {
+    int r = sending_ ? Error::BUSY : resendRequest(req);
+    if (r == Error::LIMIT_EXCEEDED || r == Error::BUSY) {
+        // The transport can't send right now, make another attempt after a random delay
+        Log.trace("Request retry postponed, request ID: %u", req.id);
+        startTimer(req, retryJitter(req.data.size()));
+        return 0;
+    }
+    CHECK(r);
+    ++req.retries; // Postponed attempts don't count towards the limit
+    Log.trace("Request sent again, request ID: %u, retry: %u", req.id, req.retries);
+    const uint64_t timeout = (uint64_t)req.timeout * req.options.backoff();
+    req.timeout = std::min<uint64_t>(timeout, MAX_RETRY_TIMEOUT);
+    if (outTransfers_.find(transferKey(req.id, false /* response */)) == outTransfers_.end()) {
+        startTimer(req, req.timeout + retryJitter(req.data.size()));
+    } // Otherwise the timer is started once the blocks are delivered, see blockAcked()
+    return 0;
+}
+
+int MessageChannel::resendRequest(OutRequest& req) {
+    auto it = outTransfers_.find(transferKey(req.id, false /* response */));
+    if (it != outTransfers_.end()) {
+        // The request is sent in blocks and some of them may have been lost. Send all of them again
+        auto& t = it->second;
+        t->pending |= blockMask(t->blockCount) & ~t->unacked;
+        t->lastTime = millis();
+        return 0;
+    }
+    FrameHeader h;
+    h.requestTypeOrResultCode(req.type);
+    h.frameType(FrameType::REQUEST);
+    h.requestId(req.id);
+    char headerData[MAX_FRAME_HEADER_SIZE] = {};
+    size_t headerSize = CHECK(encodeFrameHeader(headerData, sizeof(headerData), h));
+    if (headerSize + req.data.size() > maxPayloadSize_) {
+        util::Buffer data(req.data.data(), req.data.size());
+        if (data.size() != req.data.size()) {
+            return Error::NO_MEMORY;
+        }
+        CHECK(startTransfer(req.id, req.type, FrameType::REQUEST, std::move(data), req.options.confirmed(), nullptr /* onAck */));
+    } else {
+        CHECK(sendFrame(h, req.data.data(), req.data.size(), req.options.confirmed(), nullptr /* onAck */));
+    }
+    return 0;
+}
+
+system_tick_t MessageChannel::retryJitter(size_t size) const {
+    system_tick_t maxJitter = MIN_RETRY_JITTER;
+    if (conf_.timeOnAir_) {
+        // A request that doesn't fit in a single frame takes at least one full frame to send
+        const auto frameSize = std::min(size + MAX_FRAME_HEADER_SIZE, maxPayloadSize_);
+        maxJitter = std::max(maxJitter, conf_.timeOnAir_(frameSize) * RETRY_JITTER_AIRTIMES);
+    }
+    return 1 + (system_tick_t)std::rand() % maxJitter;
+}
+
+unsigned MessageChannel::nextRequestId() {
+    auto id = nextOutReqId_;
+    if (++nextOutReqId_ > MAX_REQUEST_ID) {
+        nextOutReqId_ = 0;
+    }
+    return id;
+}
+
+MessageChannel::OutRequest* MessageChannel::findOutRequest(unsigned id) {
+    auto& slot = outReqs_[id % MAX_PENDING_REQUESTS];
+    if (!slot.used || slot.id != id) {
+        return nullptr;
+    }
+    return &slot;
+}
+
+MessageChannel::OutRequest MessageChannel::takeOutRequest(OutRequest& req) {
+    // The request callbacks may send new requests, so release the slot before they are called
+    OutRequest r = std::move(req);
+    req = OutRequest();
+    return r;
+}
+
+MessageChannel::RecentRequest* MessageChannel::findRecentRequest(unsigned id, unsigned sessionId) {
+    auto& r = recentReqs_[id % MAX_RECENT_REQUESTS];
+    if (!r.used || r.id != id || r.sessionId != sessionId || millis() - r.time >= RECENT_REQUEST_TTL) {
+        return nullptr;
+    }
+    return &r;
+}
+
+void MessageChannel::failTransfer(RefCountPtr<OutTransfer> t, int error) {
+    Log.error("Failed to send blocks, request ID: %u, error: %d", t->id, error);
+    outTransfers_.remove(transferKey(t->id, t->response));
+    if (t->onAck && !t->acked) {
+        t->acked = true;
+        t->onAck(error);
+    }
+    if (!t->response) {
+        auto slot = findOutRequest(t->id);
+        if (slot) {
+            auto req = takeOutRequest(*slot);
+            if (req.onResponse) {
+                req.onResponse(error, 0, util::Buffer());
+            }
+        }
+    }
+}
+
+void MessageChannel::processTransfers() {
+    const auto now = millis();
+    if (sending_ && now - sendTime_ >= SEND_TIMEOUT) {
+        sending_ = false; // The transport never reported the outcome
+    }
+
+    // Discard the transfers that made no progress. The callbacks may start new transfers, so collect them first
+    Vector<RefCountPtr<OutTransfer>> expired;
+    for (auto it = outTransfers_.begin(); it != outTransfers_.end();) {
+        if (now - it->second->lastTime >= TRANSFER_TIMEOUT) {
+            expired.append(std::move(it->second));
+            it = outTransfers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto& t: expired) {
+        if (t->pending || t->unacked) {
+            failTransfer(t, Error::TIMEOUT);
+        }
+    }
+    for (auto it = inTransfers_.begin(); it != inTransfers_.end();) {
+        auto& t = it->second;
+        if (now - t->lastTime >= TRANSFER_TIMEOUT) {
+            Log.warn("Incomplete transfer discarded, request ID: %u", t->id);
+            it = inTransfers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (sending_) {
+        return;
+    }
+
+    // Request the missing blocks of an incoming transfer
+    RefCountPtr<InTransfer> inTransfer;
+    for (auto& [key, t]: inTransfers_) {
+        if ((t->resendNow || now - t->lastTime >= RESEND_REQUEST_DELAY) && t->resendRequests < MAX_RESEND_REQUESTS) {
+            inTransfer = t;
+            break;
+        }
+    }
+    if (inTransfer) {
+        inTransfer->resendNow = false;
+        inTransfer->lastTime = now;
+        ++inTransfer->resendRequests;
+        int r = sendResendRequest(inTransfer);
+        if (r < 0) {
+            Log.error("Failed to request missing blocks: %d", r);
+        }
+        return;
+    }
+
+    // Send the next block of an outgoing transfer
+    RefCountPtr<OutTransfer> outTransfer;
+    for (auto& [key, t]: outTransfers_) {
+        if (t->pending && (!t->delayed || now - t->retryTime >= BLOCK_SEND_RETRY_DELAY)) {
+            outTransfer = t;
+            break;
+        }
+    }
+    if (outTransfer) {
+        int r = sendBlock(outTransfer, lowestBlock(outTransfer->pending));
+        if (r == Error::LIMIT_EXCEEDED || r == Error::BUSY) {
+            // The transport can't send right now, try again later
+            outTransfer->delayed = true;
+            outTransfer->retryTime = now;
+        } else if (r < 0) {
+            failTransfer(outTransfer, r);
+        } else {
+            outTransfer->delayed = false;
+        }
+    }
+}
+
 } // namespace particle::constrained
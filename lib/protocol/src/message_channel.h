@@ -4,10 +4,12 @@
 
 #include <spark_wiring_ticks.h>
 #include <spark_wiring_map.h>
+#include <spark_wiring_vector.h>
 
 #include <ref_count.h>
 
 #include "util/buffer.h"
+#include "frame_codec.h"
 
 namespace particle::constrained {
 
@@ -18,10 +20,22 @@ public:
     typedef std::function<void(int error)> OnAck;
     typedef std::function<int(int error, int result, util::Buffer data)> OnResponse;
     typedef std::function<int(int type, util::Buffer data, OnResponse onResp)> OnRequest;
-    typedef std::function<int(util::Buffer data, int port, OnAck onAck)> OnSend;
+    typedef std::function<int(util::Buffer data, int port, bool confirmed, OnAck onAck)> OnSend;
+    typedef std::function<system_tick_t(size_t size)> TimeOnAir;
 
     static const system_tick_t DEFAULT_REQUEST_TIMEOUT = 60000;
+    static const unsigned DEFAULT_RETRY_BACKOFF = 2;
     static const unsigned DEFAULT_PORT = 223;
+    static const size_t DEFAULT_MAX_PAYLOAD_SIZE = 100;
+    // Maximum size of a request or response payload received in blocks
+    static const size_t MAX_BLOCKWISE_MESSAGE_SIZE = 2048;
+    // Maximum number of requests and responses that can be received in blocks at the same time
+    static const size_t MAX_INCOMING_BLOCKWISE_TRANSFERS = 2;
+    // Maximum number of outgoing requests waiting for a response. Must be a power of two
+    static const size_t MAX_PENDING_REQUESTS = 8;
+    // Number of recently received requests remembered in order to detect retransmissions. Must be
+    // a power of two
+    static const size_t MAX_RECENT_REQUESTS = 4;
 };
 
 class MessageChannelConfig {
@@ -45,9 +59,17 @@ public:
         return *this;
     }
 
+    // Estimate the time on air in milliseconds of a frame with the given payload size. Used to
+    // randomize the retransmissions of requests
+    MessageChannelConfig& timeOnAir(MessageChannelBase::TimeOnAir fn) {
+        timeOnAir_ = std::move(fn);
+        return *this;
+    }
+
 private:
     MessageChannelBase::OnRequest onReq_;
     MessageChannelBase::OnSend onSend_;
+    MessageChannelBase::TimeOnAir timeOnAir_;
     unsigned port_;
 
     friend class MessageChannel;
@@ -57,7 +79,10 @@ class RequestOptions {
 public:
     RequestOptions() :
             timeout_(MessageChannelBase::DEFAULT_REQUEST_TIMEOUT),
-            noResp_(false) {
+            maxRetries_(0),
+            backoff_(MessageChannelBase::DEFAULT_RETRY_BACKOFF),
+            noResp_(false),
+            confirmed_(true) {
     }
 
     RequestOptions& timeout(system_tick_t timeout) {
@@ -78,9 +103,57 @@ public:
         return noResp_;
     }
 
+    // Number of times the request is sent again with the same ID if no response is received within
+    // the timeout. The recipient replies to a retransmitted request with the response it already sent
+    RequestOptions& maxRetries(unsigned count) {
+        maxRetries_ = count;
+        return *this;
+    }
+
+    unsigned maxRetries() const {
+        return maxRetries_;
+    }
+
+    // Factor by which the timeout is multiplied on every retry. A random delay proportional to the
+    // time on air of the request is added to the timeout as well
+    RequestOptions& backoff(unsigned factor) {
+        backoff_ = factor;
+        return *this;
+    }
+
+    unsigned backoff() const {
+        return backoff_;
+    }
+
+    // Request an acknowledgement from the network for the uplink carrying the request
+    RequestOptions& confirmed(bool enabled) {
+        confirmed_ = enabled;
+        return *this;
+    }
+
+    bool confirmed() const {
+        return confirmed_;
+    }
+
+    // Called when the uplink carrying the request has been acknowledged by the network (error is 0),
+    // was not acknowledged, or was sent without requesting an acknowledgement (error is 0). Not called
+    // for retransmissions
+    RequestOptions& onAck(MessageChannelBase::OnAck fn) {
+        onAck_ = std::move(fn);
+        return *this;
+    }
+
+    const MessageChannelBase::OnAck& onAck() const {
+        return onAck_;
+    }
+
 private:
+    MessageChannelBase::OnAck onAck_;
     system_tick_t timeout_;
+    unsigned maxRetries_;
+    unsigned backoff_;
     bool noResp_;
+    bool confirmed_;
 };
 
 class MessageChannel: public MessageChannelBase {
@@ -94,6 +167,10 @@ public:
     int changeMaxPayloadSize(size_t size);
     int run();
 
+    size_t maxPayloadSize() const {
+        return maxPayloadSize_;
+    }
+
     int sendRequest(unsigned type, util::Buffer data, OnResponse onResp = nullptr, RequestOptions opts = RequestOptions());
 
     int sendRequest(unsigned type, OnResponse onResp = nullptr, RequestOptions opts = RequestOptions()) {
@@ -103,17 +180,78 @@ public:
     void reset();
 
 private:
-    struct InRequest;
-    struct OutRequest;
+    struct InTransfer;
+    struct OutTransfer;
+
+    struct InRequest {
+        unsigned id;
+        unsigned sessionId;
+    };
+
+    struct OutRequest {
+        RequestOptions options;
+        OnResponse onResponse;
+        util::Buffer data; // Request data, kept only if the request can be retransmitted
+        system_tick_t deadline; // Time at which the current attempt times out, valid if `timerActive` is set
+        system_tick_t timeout; // Timeout of the current attempt, not including the random delay
+        unsigned id;
+        unsigned type;
+        unsigned retries;
+        bool timerActive;
+        bool used;
+    };
+
+    struct RecentRequest {
+        util::Buffer response; // Response data to send again if the request is retransmitted
+        system_tick_t time; // Time the request was received
+        unsigned id;
+        unsigned sessionId;
+        int result;
+        bool responded;
+        bool used;
+    };
 
-    Map<unsigned, RefCountPtr<OutRequest>> outReqs_;
+    OutRequest outReqs_[MAX_PENDING_REQUESTS]; // Indexed by request ID modulo the number of slots
+    RecentRequest recentReqs_[MAX_RECENT_REQUESTS]; // Indexed the same way
+    // Block-wise transfers are still allocated on the heap: the transfer object, its Map entry and, for
+    // incoming transfers, the list of received blocks. Messages that fit in a single frame don't use them
+    Map<unsigned, RefCountPtr<InTransfer>> inTransfers_;
+    Map<unsigned, RefCountPtr<OutTransfer>> outTransfers_;
     MessageChannelConfig conf_;
     size_t maxPayloadSize_;
+    system_tick_t sendTime_;
     unsigned nextOutReqId_;
     unsigned sessId_;
+    bool sending_;
     bool inited_;
 
-    int sendResponse(int result, util::Buffer data, RefCountPtr<InRequest> req);
+    int sendResponse(int result, util::Buffer data, const InRequest& req);
+    int sendResponse(unsigned id, int result, util::Buffer data);
+    int sendFrame(const FrameHeader& h, const char* data, size_t size, bool confirmed, OnAck onAck);
+    int sendFrame(const FrameHeader& h, util::Buffer data, bool confirmed, OnAck onAck);
+
+    int receiveRequest(unsigned type, unsigned id, bool noResp, util::Buffer data);
+    int receiveResponse(unsigned id, int result, util::Buffer data);
+    int receiveBlock(const FrameHeader& h, util::Buffer data);
+    int receiveResendRequest(unsigned id, bool response, const util::Buffer& data);
+
+    int startTransfer(unsigned id, unsigned code, FrameType type, util::Buffer data, bool confirmed, OnAck onAck);
+    int sendBlock(RefCountPtr<OutTransfer> t, unsigned num);
+    int sendResendRequest(RefCountPtr<InTransfer> t);
+    void blockAcked(unsigned key, unsigned num, int error);
+    void failTransfer(RefCountPtr<OutTransfer> t, int error);
+    void processTransfers();
+
+    void startTimer(OutRequest& req, system_tick_t timeout);
+    void expireRequests();
+    int retryRequest(OutRequest& req);
+    int resendRequest(OutRequest& req);
+    system_tick_t retryJitter(size_t size) const;
+
+    unsigned nextRequestId();
+    OutRequest* findOutRequest(unsigned id);
+    OutRequest takeOutRequest(OutRequest& req);
+    RecentRequest* findRecentRequest(unsigned id, unsigned sessionId);
 };
 
 } // namespace particle::constrained
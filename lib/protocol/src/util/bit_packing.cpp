@@ -0,0 +1,97 @@
+#include <cmath>
+
+#include <spark_wiring_error.h>
+
+#include <check.h>
+
+#include "bit_packing.h"
+
+namespace particle::util {
+
+namespace {
+
+const unsigned MAX_FIELD_BITS = 32;
+
+} // namespace
+
+int BitWriter::write(uint32_t val, unsigned bits) {
+    if (bits > MAX_FIELD_BITS) {
+        return Error::INVALID_ARGUMENT;
+    }
+    const size_t newBitCount = bitCount_ + bits;
+    const size_t startSize = buf_.size() - (bitCount_ + 7) / 8;
+    CHECK(buf_.resize(startSize + (newBitCount + 7) / 8)); // New bytes are cleared
+    char* d = buf_.data() + startSize;
+    for (size_t i = bitCount_; i < newBitCount; ++i, val >>= 1) {
+        if (val & 1) {
+            d[i / 8] |= 1 << (i % 8);
+        }
+    }
+    bitCount_ = newBitCount;
+    return 0;
+}
+
+int BitReader::read(uint32_t& val, unsigned bits) {
+    if (bits > MAX_FIELD_BITS) {
+        return Error::INVALID_ARGUMENT;
+    }
+    if (bits > bitsLeft()) {
+        return Error::NOT_ENOUGH_DATA;
+    }
+    uint32_t v = 0;
+    for (unsigned i = 0; i < bits; ++i, ++bitOffs_) {
+        if (data_[bitOffs_ / 8] & (1 << (bitOffs_ % 8))) {
+            v |= (uint32_t)1 << i;
+        }
+    }
+    val = v;
+    return 0;
+}
+
+int PackedField::encode(double val, uint32_t& raw) const {
+    if (bits_ > MAX_FIELD_BITS) {
+        return Error::INVALID_ARGUMENT;
+    }
+    const double r = std::round((val - min_) / res_);
+    if (!(r >= 0 && r <= maxRaw_)) { // Also catches NaN
+        return Error::OUT_OF_RANGE;
+    }
+    raw = r;
+    return 0;
+}
+
+bool PackedField::isInteger() const {
+    return std::trunc(min_) == min_ && std::trunc(res_) == res_;
+}
+
+int packFields(Buffer& buf, const PackedField* fields, size_t fieldCount, const double* values) {
+    const size_t startSize = buf.size();
+    BitWriter w(buf);
+    for (size_t i = 0; i < fieldCount; ++i) {
+        uint32_t raw = 0;
+        int r = fields[i].encode(values[i], raw);
+        if (r >= 0) {
+            r = w.write(raw, fields[i].bits());
+        }
+        if (r < 0) {
+            buf.resize(startSize);
+            return r;
+        }
+    }
+    return buf.size() - startSize;
+}
+
+int unpackFields(const char* data, size_t size, const PackedField* fields, size_t fieldCount, double* values) {
+    BitReader r(data, size);
+    for (size_t i = 0; i < fieldCount; ++i) {
+        uint32_t raw = 0;
+        CHECK(r.read(raw, fields[i].bits()));
+        values[i] = fields[i].decode(raw);
+    }
+    if (r.bitsLeft() >= 8) {
+        return Error::BAD_DATA; // Unexpected trailing data
+    }
+    return 0;
+}
+
+} // namespace particle::util
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+
+#include "buffer.h"
+
+namespace particle::util {
+
+// Appends values of arbitrary bit width to a buffer. Bits are written starting from the least
+// significant bit of each byte. Unused bits of the last byte are left cleared
+class BitWriter {
+public:
+    explicit BitWriter(Buffer& buf) :
+            buf_(buf),
+            bitCount_(0) {
+    }
+
+    // Write the `bits` least significant bits of the value. `bits` can't be greater than 32
+    int write(uint32_t val, unsigned bits);
+
+    size_t bitCount() const {
+        return bitCount_;
+    }
+
+private:
+    Buffer& buf_;
+    size_t bitCount_;
+};
+
+// Reads values written with BitWriter
+class BitReader {
+public:
+    BitReader(const char* data, size_t size) :
+            data_(data),
+            size_(size),
+            bitOffs_(0) {
+    }
+
+    // Read a value of `bits` width. `bits` can't be greater than 32
+    int read(uint32_t& val, unsigned bits);
+
+    size_t bitsLeft() const {
+        return size_ * 8 - bitOffs_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+    size_t bitOffs_;
+};
+
+// A numeric field encoded as an unsigned integer of the minimum width that can represent the values
+// from `min` to `max` with the given resolution. For example, a temperature from -40 to 85 with a
+// resolution of 0.1 takes 11 bits
+class PackedField {
+public:
+    constexpr PackedField(const char* name, double min, double max, double resolution = 1) :
+            name_(name),
+            min_(min),
+            res_(resolution),
+            maxRaw_(rawSteps(min, max, resolution)),
+            bits_(bitWidth(maxRaw_)) {
+    }
+
+    const char* name() const {
+        return name_;
+    }
+
+    // Number of bits taken by the field
+    unsigned bits() const {
+        return bits_;
+    }
+
+    // Returns Error::OUT_OF_RANGE if the value is outside of the field's range
+    int encode(double val, uint32_t& raw) const;
+
+    double decode(uint32_t raw) const {
+        return min_ + raw * res_;
+    }
+
+    // Whether the decoded values are always integers
+    bool isInteger() const;
+
+private:
+    const char* name_;
+    double min_;
+    double res_;
+    uint64_t maxRaw_;
+    unsigned bits_;
+
+    static constexpr uint64_t rawSteps(double min, double max, double res) {
+        return (max > min && res > 0) ? (uint64_t)((max - min) / res + 0.5) : 0;
+    }
+
+    static constexpr unsigned bitWidth(uint64_t val) {
+        unsigned n = 0;
+        while (val) {
+            val >>= 1;
+            ++n;
+        }
+        return n;
+    }
+};
+
+// Encodes the values of the fields, in order, into the minimum number of bytes. Returns the number
+// of bytes written
+int packFields(Buffer& buf, const PackedField* fields, size_t fieldCount, const double* values);
+
+// Decodes values encoded with packFields()
+int unpackFields(const char* data, size_t size, const PackedField* fields, size_t fieldCount, double* values);
+
+} // namespace particle::util
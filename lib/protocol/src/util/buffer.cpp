@@ -0,0 +1,135 @@
+#include <cstdlib>
+#include <new>
+
+#include "buffer.h"
+
+namespace particle::util {
+
+namespace {
+
+#if PARTICLE_CONSTRAINED_BUFFER_POOL_BLOCKS > 0
+
+static_assert(Buffer::POOL_BLOCK_COUNT <= 32, "Too many blocks in the buffer pool");
+
+alignas(4) char g_poolBlocks[Buffer::POOL_BLOCK_COUNT][Buffer::POOL_BLOCK_SIZE];
+uint32_t g_poolFreeBlocks = (Buffer::POOL_BLOCK_COUNT == 32) ? 0xffffffffu : (1u << Buffer::POOL_BLOCK_COUNT) - 1;
+
+char* allocPoolBlock() {
+    if (!g_poolFreeBlocks) {
+        return nullptr;
+    }
+    unsigned i = 0;
+    while (!(g_poolFreeBlocks & (1u << i))) {
+        ++i;
+    }
+    g_poolFreeBlocks &= ~(1u << i);
+    return g_poolBlocks[i];
+}
+
+bool freePoolBlock(char* ptr) {
+    const auto addr = (uintptr_t)ptr;
+    const auto start = (uintptr_t)g_poolBlocks;
+    if (addr < start || addr >= start + sizeof(g_poolBlocks)) {
+        return false;
+    }
+    const unsigned i = (addr - start) / Buffer::POOL_BLOCK_SIZE;
+    g_poolFreeBlocks |= 1u << i;
+    return true;
+}
+
+#else
+
+inline char* allocPoolBlock() {
+    return nullptr;
+}
+
+inline bool freePoolBlock(char* ptr) {
+    return false;
+}
+
+#endif // PARTICLE_CONSTRAINED_BUFFER_POOL_BLOCKS > 0
+
+} // namespace
+
+struct Buffer::SharedData {
+    Buffer buf;
+    unsigned refCount;
+
+    SharedData() :
+            refCount(1) {
+    }
+};
+
+int Buffer::share() {
+    if (shared_) {
+        return 0;
+    }
+    auto d = new(std::nothrow) SharedData();
+    if (!d) {
+        return Error::NO_MEMORY;
+    }
+    d->buf.move(*this);
+    data_ = d->buf.data_;
+    size_ = d->buf.size_;
+    offs_ = d->buf.offs_;
+    capacity_ = offs_ + size_;
+    shared_ = d;
+    return 0;
+}
+
+void Buffer::copy(const Buffer& buf) {
+    if (buf.shared_) {
+        data_ = buf.data_;
+        size_ = buf.size_;
+        capacity_ = buf.capacity_;
+        offs_ = buf.offs_;
+        shared_ = buf.shared_;
+        ++shared_->refCount;
+    } else if (buf.size_ && resize(buf.size_) == 0) {
+        std::memcpy(data_, buf.data(), buf.size_);
+    }
+}
+
+int Buffer::grow(size_t capacity) {
+    char* d = nullptr;
+    if (capacity <= POOL_BLOCK_SIZE) {
+        d = allocPoolBlock();
+        if (d) {
+            capacity = POOL_BLOCK_SIZE;
+        }
+    }
+    if (!d) {
+        // Grow geometrically as the buffers are often filled incrementally
+        capacity = std::max(capacity, capacity_ + capacity_ / 2);
+        d = (char*)std::malloc(capacity);
+        if (!d) {
+            return Error::NO_MEMORY;
+        }
+    }
+    std::memcpy(d, data_, offs_ + size_);
+    freeData();
+    data_ = d;
+    capacity_ = capacity;
+    return 0;
+}
+
+void Buffer::freeData() {
+    if (shared_) {
+        if (!--shared_->refCount) {
+            delete shared_;
+        }
+        shared_ = nullptr;
+    } else if (data_ != inline_ && !freePoolBlock(data_)) {
+        std::free(data_);
+    }
+}
+
+void Buffer::release() {
+    freeData();
+    data_ = inline_;
+    size_ = 0;
+    capacity_ = INLINE_CAPACITY;
+    offs_ = 0;
+}
+
+} // namespace particle::util
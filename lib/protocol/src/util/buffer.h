@@ -1,43 +1,203 @@
 #pragma once
 
-#include <spark_wiring_vector.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
 #include <spark_wiring_error.h>
 
+// Number of blocks in the pool of buffer memory. Can be set to 0 to disable the pool
+#ifndef PARTICLE_CONSTRAINED_BUFFER_POOL_BLOCKS
+#define PARTICLE_CONSTRAINED_BUFFER_POOL_BLOCKS 8
+#endif
+
 namespace particle::util {
 
+// The buffer may keep unused space in front of its data (headroom) so that a header can be prepended
+// and consumed without moving the data.
+//
+// Small buffers are stored inline. Larger buffers that fit in a LoRaWAN frame are allocated from a
+// fixed pool of blocks if one is available, and only the buffers that don't are allocated on the heap.
+// The pool is not thread-safe; buffers are expected to be used from a single thread.
+//
+// A buffer can be made to share its data with its copies instead of copying it (see share()). The
+// shared data is reference-counted and read-only: a buffer that shares its data gets its own copy of
+// it before it's modified by any of the methods below, except that the data must not be modified via
+// the pointer returned by data()
 class Buffer {
 public:
-    Buffer() = default;
+    // Size of the storage embedded in the buffer
+    static const size_t INLINE_CAPACITY = 64;
+    // Size of a block of the pool
+    static const size_t POOL_BLOCK_SIZE = 256;
+    static const size_t POOL_BLOCK_COUNT = PARTICLE_CONSTRAINED_BUFFER_POOL_BLOCKS;
+
+    Buffer() :
+            data_(inline_),
+            size_(0),
+            capacity_(INLINE_CAPACITY),
+            offs_(0),
+            shared_(nullptr) {
+    }
 
+    // The buffer is left empty if memory can't be allocated
     explicit Buffer(size_t size) :
-            d_(size) {
+            Buffer() {
+        resize(size);
     }
 
     Buffer(const char* data, size_t size) :
-            d_(data, size) {
+            Buffer() {
+        if (size && resize(size) == 0) {
+            std::memcpy(data_, data, size);
+        }
+    }
+
+    // The headroom is only preserved if the data is shared
+    Buffer(const Buffer& buf) :
+            Buffer() {
+        copy(buf);
+    }
+
+    Buffer(Buffer&& buf) :
+            Buffer() {
+        move(buf);
+    }
+
+    ~Buffer() {
+        release();
     }
 
     char* data() {
-        return d_.data();
+        return data_ + offs_;
     }
 
     const char* data() const {
-        return d_.data();
+        return data_ + offs_;
     }
 
     size_t size() const {
-        return d_.size();
+        return size_;
     }
 
+    // New bytes are zero-initialized
     int resize(size_t size) {
-        if (!d_.resize(size)) {
-            return Error::NO_MEMORY;
+        if (offs_ + size > capacity_ || (shared_ && size > size_)) {
+            int r = grow(offs_ + size);
+            if (r < 0) {
+                return r;
+            }
+        }
+        if (size > size_) {
+            std::memset(data_ + offs_ + size_, 0, size - size_);
+        }
+        size_ = size;
+        return 0;
+    }
+
+    // Make sure the buffer can hold `size` bytes of data without reallocating
+    int reserve(size_t size) {
+        if (offs_ + size > capacity_ || shared_) {
+            return grow(offs_ + std::max(size, size_));
+        }
+        return 0;
+    }
+
+    size_t headroom() const {
+        return offs_;
+    }
+
+    // Make sure there's at least `size` bytes of headroom. The data is moved if necessary
+    int reserveHeadroom(size_t size) {
+        if (offs_ >= size && !shared_) {
+            return 0;
+        }
+        if (size + size_ > capacity_ || shared_) {
+            int r = grow(std::max(size, offs_) + size_);
+            if (r < 0) {
+                return r;
+            }
+        }
+        if (offs_ < size) {
+            std::memmove(data_ + size, data_ + offs_, size_);
+            offs_ = size;
         }
         return 0;
     }
 
+    // Insert data at the beginning of the buffer. Uses the headroom if there's enough of it
+    int prepend(const char* data, size_t size) {
+        if (offs_ < size || shared_) {
+            int r = reserveHeadroom(size);
+            if (r < 0) {
+                return r;
+            }
+        }
+        offs_ -= size;
+        size_ += size;
+        std::memcpy(data_ + offs_, data, size);
+        return 0;
+    }
+
+    // Remove data from the beginning of the buffer. The removed bytes become headroom
+    void trimFront(size_t size) {
+        size = std::min(size, size_);
+        offs_ += size;
+        size_ -= size;
+    }
+
+    // Make the copies of the buffer share its data, including the headroom. Sharing small buffers that
+    // are stored inline is not worth it as it allocates the reference counter on the heap
+    int share();
+
+    Buffer& operator=(const Buffer& buf) {
+        if (this != &buf) {
+            Buffer b(buf);
+            release();
+            move(b);
+        }
+        return *this;
+    }
+
+    Buffer& operator=(Buffer&& buf) {
+        if (this != &buf) {
+            release();
+            move(buf);
+        }
+        return *this;
+    }
+
 private:
-    Vector<char> d_;
+    struct SharedData;
+
+    char* data_; // Points to `inline_`, a block of the pool, heap memory or the data of `shared_`
+    size_t size_;
+    size_t capacity_;
+    size_t offs_;
+    SharedData* shared_; // Data shared with other buffers, or null if the data is owned by this buffer
+    char inline_[INLINE_CAPACITY];
+
+    int grow(size_t capacity);
+    void freeData();
+    void release();
+    void copy(const Buffer& buf);
+
+    void move(Buffer& buf) {
+        if (buf.data_ == buf.inline_) {
+            std::memcpy(inline_, buf.inline_, buf.offs_ + buf.size_);
+        } else {
+            data_ = buf.data_;
+            capacity_ = buf.capacity_;
+        }
+        size_ = buf.size_;
+        offs_ = buf.offs_;
+        shared_ = buf.shared_;
+        buf.data_ = buf.inline_;
+        buf.size_ = 0;
+        buf.capacity_ = INLINE_CAPACITY;
+        buf.offs_ = 0;
+        buf.shared_ = nullptr;
+    }
 };
 
 } // namespace particle::util
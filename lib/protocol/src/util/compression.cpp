@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstdint>
+
+#include <spark_wiring_error.h>
+
+#include <check.h>
+
+#include "compression.h"
+
+namespace particle::util {
+
+namespace {
+
+// The compressed data is a sequence of groups of up to 8 items, each preceded by a control byte. Bit N
+// of the control byte, starting from the least significant bit, is set if item N is a literal byte and
+// cleared if it is a back-reference. A back-reference is 2 bytes: a 12-bit distance minus 1 followed by
+// a 4-bit length minus MIN_MATCH_LENGTH.
+//
+// The data is compressed as if it were preceded by the dictionary so that back-references can point into
+// it. The dictionary contains fragments that are common in CBOR-encoded event data. It is shared with
+// the cloud and must not be modified without introducing a new request flag
+const char DICTIONARY[] =
+        "\xa1" "\xa2" "\xa3" "\xa4" "\xf4" "\xf5" "\xf6"
+        "\x62" "id" "\x63" "alt" "\x63" "lat" "\x63" "lon" "\x63" "rssi" "\x63" "snr"
+        "\x64" "name" "\x64" "type" "\x64" "time" "\x64" "data" "\x64" "mode" "\x64" "temp"
+        "\x65" "value" "\x65" "count" "\x65" "level" "\x65" "state" "\x65" "error" "\x65" "alarm"
+        "\x66" "status" "\x66" "signal" "\x66" "uptime" "\x66" "events"
+        "\x67" "battery" "\x67" "voltage" "\x67" "current" "\x67" "message" "\x67" "version"
+        "\x68" "humidity" "\x68" "pressure" "\x68" "location" "\x68" "interval"
+        "\x69" "timestamp" "\x6b" "temperature"
+        "\x63" "foo" "\x63" "bar";
+
+const size_t DICTIONARY_SIZE = sizeof(DICTIONARY) - 1; // Excluding the terminating null
+
+const size_t MIN_MATCH_LENGTH = 3;
+const size_t MAX_MATCH_LENGTH = MIN_MATCH_LENGTH + 0x0f;
+const size_t MAX_DISTANCE = 0x1000;
+
+// Returns a byte at the given position of the dictionary followed by the data
+inline char windowByte(const char* data, size_t pos) {
+    return (pos < DICTIONARY_SIZE) ? DICTIONARY[pos] : data[pos - DICTIONARY_SIZE];
+}
+
+int appendByte(Buffer& buf, char b) {
+    CHECK(buf.resize(buf.size() + 1));
+    buf.data()[buf.size() - 1] = b;
+    return 0;
+}
+
+} // namespace
+
+int compress(Buffer& buf, const char* data, size_t size) {
+    const size_t startSize = buf.size();
+    size_t ctrlOffs = 0;
+    unsigned itemCount = 8; // Number of items in the current group
+    const size_t end = DICTIONARY_SIZE + size;
+    size_t pos = DICTIONARY_SIZE;
+    while (pos < end) {
+        if (itemCount == 8) {
+            ctrlOffs = buf.size();
+            CHECK(appendByte(buf, 0));
+            itemCount = 0;
+        }
+        // Find the longest match in the window. The payloads are small, so a linear search is good enough
+        const size_t maxLen = std::min(MAX_MATCH_LENGTH, end - pos);
+        size_t matchLen = 0;
+        size_t matchPos = 0;
+        size_t from = (pos > MAX_DISTANCE) ? pos - MAX_DISTANCE : 0;
+        for (size_t i = from; i < pos && matchLen < maxLen; ++i) {
+            size_t n = 0;
+            while (n < maxLen && windowByte(data, i + n) == windowByte(data, pos + n)) {
+                ++n;
+            }
+            if (n > matchLen) {
+                matchLen = n;
+                matchPos = i;
+            }
+        }
+        if (matchLen >= MIN_MATCH_LENGTH) {
+            const unsigned dist = pos - matchPos - 1;
+            CHECK(appendByte(buf, (dist >> 4) & 0xff));
+            CHECK(appendByte(buf, ((dist & 0x0f) << 4) | (matchLen - MIN_MATCH_LENGTH)));
+            pos += matchLen;
+        } else {
+            buf.data()[ctrlOffs] |= 1 << itemCount;
+            CHECK(appendByte(buf, windowByte(data, pos)));
+            ++pos;
+        }
+        ++itemCount;
+    }
+    return buf.size() - startSize;
+}
+
+int decompress(Buffer& buf, const char* data, size_t size, size_t maxSize) {
+    const size_t startSize = buf.size();
+    size_t offs = 0;
+    while (offs < size) {
+        const uint8_t ctrl = data[offs++];
+        for (unsigned i = 0; i < 8 && offs < size; ++i) {
+            const size_t outSize = buf.size() - startSize;
+            if (ctrl & (1 << i)) {
+                if (outSize >= maxSize) {
+                    return Error::TOO_LARGE;
+                }
+                CHECK(appendByte(buf, data[offs++]));
+                continue;
+            }
+            if (size - offs < 2) {
+                return Error::BAD_DATA;
+            }
+            const unsigned b1 = (uint8_t)data[offs++];
+            const unsigned b2 = (uint8_t)data[offs++];
+            const size_t dist = ((b1 << 4) | (b2 >> 4)) + 1;
+            const size_t len = (b2 & 0x0f) + MIN_MATCH_LENGTH;
+            const size_t pos = DICTIONARY_SIZE + outSize;
+            if (dist > pos) {
+                return Error::BAD_DATA;
+            }
+            if (outSize + len > maxSize) {
+                return Error::TOO_LARGE;
+            }
+            // The source of the reference may overlap the bytes being written, so copy them one by one
+            for (size_t j = 0; j < len; ++j) {
+                CHECK(appendByte(buf, windowByte(buf.data() + startSize, pos - dist + j)));
+            }
+        }
+    }
+    return buf.size() - startSize;
+}
+
+} // namespace particle::util
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "buffer.h"
+
+namespace particle::util {
+
+// Compresses the data using LZSS with a static dictionary that is shared with the cloud. The
+// compressed data is appended to the buffer. Returns the number of bytes written
+int compress(Buffer& buf, const char* data, size_t size);
+
+// Decompresses the data compressed with compress(). The decompressed data is appended to the buffer.
+// Returns the number of bytes written or an error if the decompressed data would exceed `maxSize`
+int decompress(Buffer& buf, const char* data, size_t size, size_t maxSize);
+
+} // namespace particle::util
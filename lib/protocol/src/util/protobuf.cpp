@@ -10,7 +10,10 @@
 
 namespace particle::util {
 
-int encodeProtobuf(Buffer& buf, const void* msg, const pb_msgdesc_t* desc) {
+namespace {
+
+// Appends to the buffer
+pb_ostream_t bufferOutputStream(Buffer& buf) {
     pb_ostream_t strm = {};
     strm.state = &buf;
     strm.max_size = SIZE_MAX;
@@ -22,10 +25,28 @@ int encodeProtobuf(Buffer& buf, const void* msg, const pb_msgdesc_t* desc) {
         std::memcpy(buf->data() + buf->size() - size, data, size);
         return true;
     };
+    return strm;
+}
+
+} // namespace
+
+int encodeProtobuf(Buffer& buf, const void* msg, const pb_msgdesc_t* desc) {
+    // Compute the size of the message first so that the buffer is resized only once
+    size_t size = 0;
+    if (!pb_get_encoded_size(&size, desc, msg)) {
+        return Error::ENCODING_FAILED;
+    }
+    const size_t offs = buf.size();
+    int r = buf.resize(offs + size);
+    if (r < 0) {
+        return r;
+    }
+    auto strm = pb_ostream_from_buffer((pb_byte_t*)buf.data() + offs, size);
     if (!pb_encode(&strm, desc, msg)) {
+        buf.resize(offs);
         return Error::ENCODING_FAILED;
     }
-    return strm.bytes_written;
+    return size;
 }
 
 int decodeProtobuf(const Buffer& buf, void* msg, const pb_msgdesc_t* desc) {
@@ -37,4 +58,20 @@ int decodeProtobuf(const Buffer& buf, void* msg, const pb_msgdesc_t* desc) {
     return buf.size() - strm.bytes_left;
 }
 
+int encodeVarint(Buffer& buf, uint64_t val) {
+    auto strm = bufferOutputStream(buf);
+    if (!pb_encode_varint(&strm, val)) {
+        return Error::ENCODING_FAILED;
+    }
+    return strm.bytes_written;
+}
+
+int decodeVarint(const Buffer& buf, uint64_t& val) {
+    auto strm = pb_istream_from_buffer((const pb_byte_t*)buf.data(), buf.size());
+    if (!pb_decode_varint(&strm, &val)) {
+        return Error::BAD_DATA;
+    }
+    return buf.size() - strm.bytes_left;
+}
+
 } // namespace particle::util
@@ -9,4 +9,7 @@ namespace particle::util {
 int encodeProtobuf(Buffer& buf, const void* msg, const pb_msgdesc_t* desc);
 int decodeProtobuf(const Buffer& buf, void* msg, const pb_msgdesc_t* desc);
 
+int encodeVarint(Buffer& buf, uint64_t val);
+int decodeVarint(const Buffer& buf, uint64_t& val);
+
 } // namespace particle::util
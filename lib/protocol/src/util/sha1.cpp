@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cstring>
+
+#include "sha1.h"
+
+namespace particle::util {
+
+namespace {
+
+inline uint32_t rotl(uint32_t val, unsigned n) {
+    return (val << n) | (val >> (32 - n));
+}
+
+} // namespace
+
+void Sha1::reset() {
+    state_[0] = 0x67452301;
+    state_[1] = 0xefcdab89;
+    state_[2] = 0x98badcfe;
+    state_[3] = 0x10325476;
+    state_[4] = 0xc3d2e1f0;
+    size_ = 0;
+    blockSize_ = 0;
+}
+
+void Sha1::update(const char* data, size_t size) {
+    size_ += size;
+    while (size > 0) {
+        const size_t n = std::min(sizeof(block_) - blockSize_, size);
+        std::memcpy(block_ + blockSize_, data, n);
+        blockSize_ += n;
+        data += n;
+        size -= n;
+        if (blockSize_ == sizeof(block_)) {
+            processBlock();
+        }
+    }
+}
+
+void Sha1::finish(char* hash) {
+    const uint64_t bitSize = size_ * 8;
+    block_[blockSize_++] = 0x80;
+    if (blockSize_ > sizeof(block_) - 8) {
+        std::memset(block_ + blockSize_, 0, sizeof(block_) - blockSize_);
+        processBlock();
+    }
+    std::memset(block_ + blockSize_, 0, sizeof(block_) - 8 - blockSize_);
+    for (unsigned i = 0; i < 8; ++i) {
+        block_[sizeof(block_) - 1 - i] = bitSize >> (i * 8);
+    }
+    processBlock();
+    for (unsigned i = 0; i < 5; ++i) {
+        hash[i * 4] = state_[i] >> 24;
+        hash[i * 4 + 1] = state_[i] >> 16;
+        hash[i * 4 + 2] = state_[i] >> 8;
+        hash[i * 4 + 3] = state_[i];
+    }
+}
+
+void Sha1::processBlock() {
+    uint32_t w[80];
+    for (unsigned i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t)block_[i * 4] << 24) | ((uint32_t)block_[i * 4 + 1] << 16) |
+                ((uint32_t)block_[i * 4 + 2] << 8) | block_[i * 4 + 3];
+    }
+    for (unsigned i = 16; i < 80; ++i) {
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = state_[0];
+    uint32_t b = state_[1];
+    uint32_t c = state_[2];
+    uint32_t d = state_[3];
+    uint32_t e = state_[4];
+    for (unsigned i = 0; i < 80; ++i) {
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        const uint32_t t = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = t;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    blockSize_ = 0;
+}
+
+} // namespace particle::util
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particle::util {
+
+// Incremental SHA-1. Used to compute the description hashes expected by the cloud
+class Sha1 {
+public:
+    static const size_t HASH_SIZE = 20;
+
+    Sha1() {
+        reset();
+    }
+
+    void reset();
+    void update(const char* data, size_t size);
+    // Write the hash to `hash`. The object needs to be reset before it can be reused
+    void finish(char* hash);
+
+private:
+    uint32_t state_[5];
+    uint64_t size_; // Total size of the data in bytes
+    uint8_t block_[64];
+    size_t blockSize_;
+
+    void processBlock();
+};
+
+} // namespace particle::util
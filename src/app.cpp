@@ -34,6 +34,9 @@ const auto CTRL_REQUEST_KEYS_RESP_DATA_SIZE = 24;
 // XXX: Change this if the DCT layout changes
 const auto DCT_RESERVED2_OFFSET = 8172;
 
+// LoRaWAN library state is stored right after the keys
+const auto LORAWAN_DCT_OFFSET = DCT_RESERVED2_OFFSET + CTRL_REQUEST_KEYS_RESP_DATA_SIZE;
+
 const auto AUX_3V3_POWER_CONTROL_IO = D7;
 
 int writeKeysToDCT(void* data, size_t size) {
@@ -110,7 +113,12 @@ void setup()
             .defaultDevEui()
             // .devEui(devEui)
             .joinEui(joinEui)
-            .appKey(appKey);
+            .appKey(appKey)
+            .region(LoRaWANRegion::US915)
+            .airtimeBudget(AirtimeBudgetConfig().dailyLimit(30000)) // Fair use policy of The Things Network
+            .eventBatching(60000) // Send the events of one minute in a single uplink
+            .dctOffset(LORAWAN_DCT_OFFSET)
+            .keepSession(true);
     int begin = lora.begin(std::move(conf));
     lora.process();
 
@@ -142,7 +150,7 @@ void loop()
     static uint32_t s = millis() - 20000;
     static uint32_t fcnt = 0;
     if (lora.getNwJoinStatus() == NW_JOIN_SUCCESS) {
-        if (millis() - s > 20000) {
+        if (millis() - s > 20000 && System.millis() >= lora.nextSendAllowedAt()) {
             // if (fcnt == 2) {
             //     lora.disconnect();
             // } else if (fcnt == 4) {
@@ -152,7 +160,7 @@ void loop()
             Variant v;
             v["foo"] = "bar";
             v["count"] = fcnt;
-            lora.publish(123 /* code */, v);
+            lora.publish(123 /* code */, v, particle::constrained::PublishOptions().compressed(true));
             s = millis();
             fcnt++;
         }
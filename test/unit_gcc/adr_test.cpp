@@ -0,0 +1,110 @@
+#include "test.h"
+
+#include "adr/data_rate_controller.h"
+
+using namespace particle;
+
+namespace {
+
+DataRateController makeController(unsigned dataRate) {
+    DataRateController adr;
+    adr.init(DataRateControllerConfig().enabled(true).historySize(4));
+    adr.reset(LoRaWANRegion::US915, dataRate);
+    return adr;
+}
+
+void testRaisesDataRateOnHighMargin() {
+    auto adr = makeController(1 /* SF9, demodulation floor at -12.5 dB */);
+    // 5 dB leaves 7.5 dB on top of the floor and the default 10 dB margin
+    for (int i = 0; i < 3; ++i) {
+        adr.uplinkAcked(-100, 5);
+        EXPECT_EQ(adr.dataRate(), 1); // Not enough samples yet
+    }
+    adr.uplinkAcked(-100, 5);
+    EXPECT_EQ(adr.dataRate(), 2);
+    // The history is cleared after every change
+    for (int i = 0; i < 4; ++i) {
+        adr.uplinkAcked(-100, 5);
+    }
+    EXPECT_EQ(adr.dataRate(), 3);
+    // DR 4 uses a 500 kHz channel and is never selected by default
+    for (int i = 0; i < 4; ++i) {
+        adr.uplinkAcked(-100, 20);
+    }
+    EXPECT_EQ(adr.dataRate(), 3);
+}
+
+void testLowersDataRateOnNegativeMargin() {
+    auto adr = makeController(3 /* SF7, demodulation floor at -7.5 dB */);
+    for (int i = 0; i < 4; ++i) {
+        adr.uplinkAcked(-120, -5);
+    }
+    EXPECT_EQ(adr.dataRate(), 2);
+    for (int i = 0; i < 8; ++i) {
+        adr.uplinkAcked(-120, -5);
+    }
+    EXPECT_EQ(adr.dataRate(), 0);
+    // Never goes below the minimum data rate
+    for (int i = 0; i < 4; ++i) {
+        adr.uplinkAcked(-120, -15);
+    }
+    EXPECT_EQ(adr.dataRate(), 0);
+}
+
+void testKeepsDataRateWithinHysteresis() {
+    auto adr = makeController(3);
+    // 3 dB leaves 0.5 dB on top of the floor and the margin, which is less than a step
+    for (int i = 0; i < 8; ++i) {
+        adr.uplinkAcked(-110, 3);
+    }
+    EXPECT_EQ(adr.dataRate(), 3);
+}
+
+void testUsesBestSampleOfHistory() {
+    auto adr = makeController(1);
+    adr.uplinkAcked(-100, -10);
+    adr.uplinkAcked(-100, -10);
+    adr.uplinkAcked(-100, 5);
+    adr.uplinkAcked(-100, -10);
+    EXPECT_EQ(adr.dataRate(), 2);
+}
+
+void testLowersDataRateOnMissedAcks() {
+    auto adr = makeController(3);
+    adr.uplinkMissed();
+    adr.uplinkMissed();
+    EXPECT_EQ(adr.dataRate(), 3);
+    adr.uplinkMissed();
+    EXPECT_EQ(adr.dataRate(), 2);
+    // An acknowledgement resets the count
+    adr.uplinkAcked(-110, 0);
+    for (int i = 0; i < 5; ++i) {
+        adr.uplinkMissed();
+    }
+    EXPECT_EQ(adr.dataRate(), 1);
+    adr.uplinkMissed();
+    EXPECT_EQ(adr.dataRate(), 0); // Fallback to the minimum data rate
+}
+
+void testDisabledController() {
+    DataRateController adr;
+    adr.init(DataRateControllerConfig().historySize(1));
+    adr.reset(LoRaWANRegion::US915, 1);
+    adr.uplinkAcked(-100, 20);
+    for (int i = 0; i < 6; ++i) {
+        adr.uplinkMissed();
+    }
+    EXPECT_EQ(adr.enabled(), false);
+    EXPECT_EQ(adr.dataRate(), 1);
+}
+
+} // namespace
+
+void runAdrTests() {
+    testRaisesDataRateOnHighMargin();
+    testLowersDataRateOnNegativeMargin();
+    testKeepsDataRateWithinHysteresis();
+    testUsesBestSampleOfHistory();
+    testLowersDataRateOnMissedAcks();
+    testDisabledController();
+}
@@ -0,0 +1,34 @@
+#include <application.h>
+
+#include <cstdlib>
+
+#include "test.h"
+
+// Host-side unit tests of the LoRaWAN and protocol libraries. See test/Makefile for how to build and run them.
+// The application exits with a non-zero status if any of the checks fail
+
+SYSTEM_MODE(MANUAL)
+
+int failedChecks = 0;
+
+namespace {
+
+SerialLogHandler logHandler(LOG_LEVEL_WARN, {
+    { "app", LOG_LEVEL_ALL }
+});
+
+} // namespace
+
+void setup() {
+    runAdrTests();
+    runCompressionTests();
+    if (failedChecks) {
+        Log.error("%d check(s) failed", failedChecks);
+        exit(1);
+    }
+    Log.info("All checks passed");
+    exit(0);
+}
+
+void loop() {
+}
@@ -0,0 +1,3 @@
+APP_PATH = $(MODULE_PATH)/$(USRSRC)
+
+INCLUDE_DIRS += $(APP_PATH)
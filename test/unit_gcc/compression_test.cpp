@@ -0,0 +1,124 @@
+#include "test.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "util/compression.h"
+
+using namespace particle;
+
+namespace {
+
+struct Payload {
+    const char* name;
+    const char* data;
+    size_t size;
+};
+
+#define PAYLOAD(_name, _data) { _name, _data, sizeof(_data) - 1 }
+
+// CBOR-encoded event data as published by typical applications
+const Payload EVENTS[] = {
+    PAYLOAD("counter", "\xa2\x63" "foo\x63" "bar\x65" "count\x18\x2a"),
+    PAYLOAD("climate", "\xa3\x6b" "temperature\xfa\x41\xb4\x00\x00\x68" "humidity\x18\x37\x67" "battery\x18\x5f"),
+    PAYLOAD("location", "\xa3\x63" "lat\xfa\x42\x21\x0f\x5c\x63" "lon\xfa\xc2\xf3\x4b\x85\x63" "alt\x19\x01\x2c"),
+    PAYLOAD("status", "\xa3\x66" "status\x62" "ok\x66" "uptime\x19\x30\x39\x64" "rssi\x38\x4f"),
+    PAYLOAD("reading", "\xa2\x65" "value\xfb\x40\x09\x21\xf9\xf0\x1b\x86\x6e\x69" "timestamp\x1a\x66\x3c\x8a\x00")
+};
+
+// Number of times each event is compressed and decompressed when measuring the time it takes
+const unsigned BENCHMARK_ITERATIONS = 1000;
+
+// The protocol sends the compressed data only if it is smaller than the original, see
+// CloudProtocol::sendEventRequest(). Returns the number of bytes that go on the wire
+size_t wireSize(const util::Buffer& compressed, size_t size) {
+    return std::min(compressed.size(), size);
+}
+
+bool roundTrip(const char* data, size_t size, util::Buffer& compressed) {
+    if (util::compress(compressed, data, size) < 0) {
+        return false;
+    }
+    util::Buffer buf;
+    int r = util::decompress(buf, compressed.data(), compressed.size(), size);
+    return r == (int)size && std::memcmp(buf.data(), data, size) == 0;
+}
+
+void testTypicalEventsShrink() {
+    size_t totalSize = 0;
+    size_t totalCompressed = 0;
+    for (const auto& e: EVENTS) {
+        util::Buffer c;
+        EXPECT(roundTrip(e.data, e.size, c));
+        EXPECT(c.size() < e.size);
+        Log.info("%s: %u -> %u bytes", e.name, (unsigned)e.size, (unsigned)c.size());
+        totalSize += e.size;
+        totalCompressed += c.size();
+    }
+    Log.info("Total: %u -> %u bytes", (unsigned)totalSize, (unsigned)totalCompressed);
+}
+
+void testIncompressibleDataIsBounded() {
+    srand(1);
+    for (size_t size = 0; size <= 512; ++size) {
+        util::Buffer data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data.data()[i] = rand();
+        }
+        util::Buffer c;
+        EXPECT(roundTrip(data.data(), size, c));
+        // Every group of up to 8 literals costs one control byte
+        EXPECT(c.size() <= size + (size + 7) / 8);
+        // Enabling compression never makes the request larger
+        EXPECT(wireSize(c, size) <= size);
+    }
+}
+
+void testRepetitiveData() {
+    util::Buffer data(300);
+    std::memset(data.data(), 'a', data.size());
+    util::Buffer c;
+    EXPECT(roundTrip(data.data(), data.size(), c));
+    EXPECT(c.size() < data.size() / 4);
+}
+
+void testDecompressionLimit() {
+    const auto& e = EVENTS[1];
+    util::Buffer c;
+    EXPECT(util::compress(c, e.data, e.size) > 0);
+    util::Buffer buf;
+    EXPECT(util::decompress(buf, c.data(), c.size(), e.size - 1) == Error::TOO_LARGE);
+}
+
+// Logs the average time it takes to compress and decompress each of the typical events. The time depends on
+// the machine running the test and isn't checked; it's meant for comparing changes to the algorithm
+void benchmarkTypicalEvents() {
+    for (const auto& e: EVENTS) {
+        util::Buffer c;
+        EXPECT(util::compress(c, e.data, e.size) > 0);
+        auto t = micros();
+        for (unsigned i = 0; i < BENCHMARK_ITERATIONS; ++i) {
+            util::Buffer buf;
+            util::compress(buf, e.data, e.size);
+        }
+        const unsigned compressTime = micros() - t;
+        t = micros();
+        for (unsigned i = 0; i < BENCHMARK_ITERATIONS; ++i) {
+            util::Buffer buf;
+            util::decompress(buf, c.data(), c.size(), e.size);
+        }
+        const unsigned decompressTime = micros() - t;
+        Log.info("%s: compression %u ns, decompression %u ns", e.name,
+                compressTime * 1000 / BENCHMARK_ITERATIONS, decompressTime * 1000 / BENCHMARK_ITERATIONS);
+    }
+}
+
+} // namespace
+
+void runCompressionTests() {
+    testTypicalEventsShrink();
+    testIncompressibleDataIsBounded();
+    testRepetitiveData();
+    testDecompressionLimit();
+    benchmarkTypicalEvents();
+}
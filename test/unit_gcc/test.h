@@ -0,0 +1,29 @@
+#pragma once
+
+#include <application.h>
+
+// Checks shared by the test suites. A failed check is logged and counted, and the application exits
+// with a non-zero status once all suites have run
+
+extern int failedChecks;
+
+#define EXPECT(_cond) \
+        do { \
+            if (!(_cond)) { \
+                Log.error("%s:%d: %s", __func__, __LINE__, #_cond); \
+                ++failedChecks; \
+            } \
+        } while (false)
+
+#define EXPECT_EQ(_actual, _expected) \
+        do { \
+            const int _a = (_actual); \
+            const int _e = (_expected); \
+            if (_a != _e) { \
+                Log.error("%s:%d: %s is %d, expected %d", __func__, __LINE__, #_actual, _a, _e); \
+                ++failedChecks; \
+            } \
+        } while (false)
+
+void runAdrTests();
+void runCompressionTests();